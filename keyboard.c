@@ -1,28 +1,43 @@
 /*
   keyboard.c — GLES2 rectangles + GLES2 text labels.
-  JSON-driven layout with optional "shift_label".
+  JSON-driven layout with optional "shift_label", compiled to a binary
+  cache in $XDG_CACHE_HOME (or ~/.cache) that later starts mmap directly.
   Depressed button effect, XTest key injection.
-  Supports multiple simultaneous presses.
+  Supports multiple simultaneous presses (XI2 multitouch, core pointer fallback).
   Shift, Caps Lock, Ctrl, and Alt toggles with proper logic.
   Shift, Ctrl, and Alt auto-release after next non-modifier key.
-  Key repeat for held keys (e.g. Backspace).
+  Key repeat for held keys (e.g. Backspace) at the XKB rate, per-key
+  "repeat_delay"/"repeat_interval" overrides in JSON.
   Keys can specify width/height multipliers in JSON.
+  Keys with "text" (or "macro") type a whole string in one burst.
+  Named "layers" in JSON override label/keysym per key; a key with
+  "layer" (Fn defaults to "fn") switches to one for a key or, with
+  "layer_lock", until pressed again.
+  Saving the layout file reloads it in place (inotify).
   Window occupies bottom third of the screen.
+  Frame-time histograms go to stderr on SIGUSR1 and at exit.
 
   Build:
-    gcc keyboard.c -o keyboard -lcjson -lX11 -lXtst -lEGL -lGLESv2 -lm
+    gcc keyboard.c -o keyboard -pthread -lcjson -lX11 -lX11-xcb -lxcb -lXtst -lXi -lEGL -lGLESv2 -lm
 
   Run:
     ./keyboard layout.json
+    ./keyboard --bench-hittest     (hit-test lookups/s at 100, 1k, 10k keys)
 */
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 #include <X11/keysym.h>
+#include <X11/XKBlib.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/XInput2.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 #include <stdio.h>
 #include <libgen.h>
 #include <stdlib.h>
@@ -33,6 +48,19 @@
 #include <math.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <errno.h>
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stb_truetype.h"
@@ -42,15 +70,24 @@
 bool menu_visible = false;
 int menu_pressed = -1; // -1 means none pressed
 bool keyboard_visible = false;
-int shift_down=0,caps_down=0,ctrl_down=0,alt_down=0,fn_down=0;
+int shift_down=0,caps_down=0,ctrl_down=0,alt_down=0;
+int layer_active=0;        // index into the layout's layers, 0 = base
+bool layer_locked=false;   // active layer stays until toggled off
 
 typedef struct {
     float x,y,w,h;
-    char label[64];
-    char shift_label[64];
     KeySym keysym;
+    uint32_t label, shift_label; // offsets into the layout string pool, 0 = ""
+    uint32_t text; // "text"/"macro": typed as one burst, 0 for plain keys
+    int repeat_delay;    // ms; 0 = system rate, <0 = key never repeats
+    int repeat_interval; // ms; 0 = system rate, >0 = override (never negative)
+    short layer;      // layer this key toggles ("layer" in JSON), 0 = none
+    bool layer_lock;  // toggle latches instead of lasting one key
 } Key;
 
+static const char* layout_strings=""; // string pool of the active layout
+static const char* key_str(uint32_t off){ return layout_strings+off; }
+
 /* Shader helpers */
 static GLuint make_shader(GLenum type,const char*src){
     GLuint s=glCreateShader(type);
@@ -68,6 +105,288 @@ static GLuint make_program(const char*vs,const char*fs){
     return p;
 }
 
+/* Draw-call accounting: every draw goes through here so the per-frame
+   count can be reported (see the end of the redraw block in main). */
+static int frame_draw_calls=0, last_frame_draw_calls=-1;
+static void draw_arrays(GLenum mode,GLint first,GLsizei count){
+    glDrawArrays(mode,first,count);
+    frame_draw_calls++;
+}
+static void draw_elements(GLenum mode,GLsizei count,GLenum type,const void* indices){
+    glDrawElements(mode,count,type,indices);
+    frame_draw_calls++;
+}
+
+/* Frame profiling: CPU time per render phase, plus GPU time per frame when
+   EXT_disjoint_timer_query is present. Samples land in log2 histograms
+   that are printed on SIGUSR1 and at exit. */
+enum { PROF_KEYS, PROF_LABELS, PROF_ICONS, PROF_MENU, PROF_SWAP, PROF_FRAME, PROF_GPU, PROF_N };
+static const char* prof_name[PROF_N]={"keys","labels","icons","menu","swap","frame","gpu"};
+#define PROF_BUCKETS 24 // bucket b: [2^b, 2^(b+1)) us, bucket 0 also takes <1us
+#define PROF_GPU_QUERIES 4
+
+typedef struct { unsigned hist[PROF_BUCKETS]; unsigned long n; double sum_us,max_us; } ProfHist;
+static ProfHist prof_hist[PROF_N];
+static double prof_frame_us[PROF_N];   // per-phase sums for the frame in flight
+static bool prof_frame_hit[PROF_N];
+static int prof_cur=-1;
+static struct timespec prof_mark,prof_frame_start;
+static volatile sig_atomic_t prof_dump_requested=0, quit_requested=0;
+
+static PFNGLGENQUERIESEXTPROC gl_gen_queries;
+static PFNGLBEGINQUERYEXTPROC gl_begin_query;
+static PFNGLENDQUERYEXTPROC gl_end_query;
+static PFNGLGETQUERYOBJECTUIVEXTPROC gl_get_query_uiv;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC gl_get_query_ui64v;
+static GLuint prof_query[PROF_GPU_QUERIES];
+static int prof_query_head=0, prof_query_pending=0; // ring of frames awaiting results
+static bool prof_query_active=false;
+
+static double prof_elapsed_us(const struct timespec* a,const struct timespec* b){
+    return (b->tv_sec-a->tv_sec)*1e6+(b->tv_nsec-a->tv_nsec)/1e3;
+}
+
+static void prof_record(int ph,double us){
+    ProfHist* h=&prof_hist[ph];
+    int b=0;
+    while(b<PROF_BUCKETS-1 && us>=(double)(2u<<b)) b++;
+    h->hist[b]++; h->n++; h->sum_us+=us;
+    if(us>h->max_us) h->max_us=us;
+}
+
+/* Charge the time since the last switch to the running phase and start
+   timing ph (-1 stops the clock). */
+static void prof_phase(int ph){
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    if(prof_cur>=0){
+        prof_frame_us[prof_cur]+=prof_elapsed_us(&prof_mark,&now);
+        prof_frame_hit[prof_cur]=true;
+    }
+    prof_cur=ph; prof_mark=now;
+}
+
+static void prof_gpu_init(bool available){
+    if(!available) return;
+    gl_gen_queries=(PFNGLGENQUERIESEXTPROC)eglGetProcAddress("glGenQueriesEXT");
+    gl_begin_query=(PFNGLBEGINQUERYEXTPROC)eglGetProcAddress("glBeginQueryEXT");
+    gl_end_query=(PFNGLENDQUERYEXTPROC)eglGetProcAddress("glEndQueryEXT");
+    gl_get_query_uiv=(PFNGLGETQUERYOBJECTUIVEXTPROC)eglGetProcAddress("glGetQueryObjectuivEXT");
+    gl_get_query_ui64v=(PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+    if(!gl_gen_queries||!gl_begin_query||!gl_end_query||!gl_get_query_uiv||!gl_get_query_ui64v){
+        gl_gen_queries=NULL;
+        return;
+    }
+    gl_gen_queries(PROF_GPU_QUERIES,prof_query);
+}
+
+// Harvest finished queries without stalling; drop them if the GPU clock jumped.
+static void prof_gpu_collect(void){
+    double us[PROF_GPU_QUERIES]; int got=0;
+    while(prof_query_pending>0){
+        int q=(prof_query_head-prof_query_pending+PROF_GPU_QUERIES)%PROF_GPU_QUERIES;
+        GLuint avail=0;
+        gl_get_query_uiv(prof_query[q],GL_QUERY_RESULT_AVAILABLE_EXT,&avail);
+        if(!avail) break;
+        GLuint64 ns=0;
+        gl_get_query_ui64v(prof_query[q],GL_QUERY_RESULT_EXT,&ns);
+        us[got++]=ns/1e3;
+        prof_query_pending--;
+    }
+    GLint disjoint=0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT,&disjoint);
+    if(!disjoint) for(int i=0;i<got;i++) prof_record(PROF_GPU,us[i]);
+}
+
+static void prof_frame_begin(void){
+    if(gl_gen_queries){
+        prof_gpu_collect();
+        if(prof_query_pending<PROF_GPU_QUERIES){
+            gl_begin_query(GL_TIME_ELAPSED_EXT,prof_query[prof_query_head]);
+            prof_query_active=true;
+        }
+    }
+    memset(prof_frame_us,0,sizeof(prof_frame_us));
+    memset(prof_frame_hit,0,sizeof(prof_frame_hit));
+    clock_gettime(CLOCK_MONOTONIC,&prof_frame_start);
+    prof_mark=prof_frame_start; prof_cur=-1;
+}
+
+// GPU work ends before the swap so the query doesn't include vsync waits
+static void prof_gpu_end(void){
+    if(!prof_query_active) return;
+    gl_end_query(GL_TIME_ELAPSED_EXT);
+    prof_query_head=(prof_query_head+1)%PROF_GPU_QUERIES;
+    prof_query_pending++;
+    prof_query_active=false;
+}
+
+static void prof_frame_end(void){
+    prof_phase(-1);
+    for(int ph=0;ph<PROF_FRAME;ph++)
+        if(prof_frame_hit[ph]) prof_record(ph,prof_frame_us[ph]);
+    prof_record(PROF_FRAME,prof_elapsed_us(&prof_frame_start,&prof_mark));
+}
+
+// upper bound of the bucket holding quantile q
+static unsigned prof_quantile(const ProfHist* h,double q){
+    unsigned long want=(unsigned long)(q*h->n+0.5), seen=0;
+    for(int b=0;b<PROF_BUCKETS;b++){
+        seen+=h->hist[b];
+        if(seen>=want && seen>0) return 2u<<b;
+    }
+    return 2u<<(PROF_BUCKETS-1);
+}
+
+static void prof_dump(void){
+    fprintf(stderr,"frame profile (us):\n");
+    for(int ph=0;ph<PROF_N;ph++){
+        const ProfHist* h=&prof_hist[ph];
+        if(!h->n) continue;
+        fprintf(stderr,"  %-6s n=%lu mean=%.1f p50<%u p99<%u max=%.1f\n        ",
+                prof_name[ph],h->n,h->sum_us/h->n,prof_quantile(h,0.5),prof_quantile(h,0.99),h->max_us);
+        for(int b=0;b<PROF_BUCKETS;b++)
+            if(h->hist[b]) fprintf(stderr," <%u:%u",2u<<b,h->hist[b]);
+        fputc('\n',stderr);
+    }
+}
+
+/* Touch-to-injection latency trace. Each key press gets a ring slot
+   stamped at hit-test and on presentation of its frame (main thread) and
+   when its XTest events are sent and flushed (injector). Stamps are
+   atomics, so each thread writes its own fields without locks. The X
+   event time is server milliseconds; it's only comparable when the server
+   runs on our CLOCK_MONOTONIC (local Xorg), otherwise the lag is unknown. */
+#define LAT_RING 512
+#define LAT_NONE (-1)
+enum { LAT_HIT, LAT_SENT, LAT_FLUSHED, LAT_PRESENTED, LAT_STAMPS };
+typedef struct {
+    _Atomic int id;
+    int event_lag_us;               // X event time -> hit-test, -1 unknown
+    _Atomic uint64_t t[LAT_STAMPS]; // CLOCK_MONOTONIC ns, 0 = not reached
+} LatTrace;
+static LatTrace lat_ring[LAT_RING];
+static int lat_next=0, lat_unpresented=0; // main thread only
+
+static uint64_t lat_now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000u+ts.tv_nsec;
+}
+
+static int lat_begin(Time xtime){
+    int id=lat_next;
+    lat_next=(lat_next+1)&0x7fffffff;
+    LatTrace* L=&lat_ring[id%LAT_RING];
+    atomic_store_explicit(&L->id,LAT_NONE,memory_order_relaxed);
+    for(int k=0;k<LAT_STAMPS;k++) atomic_store_explicit(&L->t[k],0,memory_order_relaxed);
+    uint64_t now=lat_now_ns();
+    int32_t lag=(int32_t)((uint32_t)(now/1000000)-(uint32_t)xtime); // 32-bit ms wrap
+    if(lag<0 && lag>-20) lag=0; // coarse server clock
+    L->event_lag_us=(lag>=0 && lag<10000)?lag*1000:-1;
+    atomic_store_explicit(&L->t[LAT_HIT],now,memory_order_relaxed);
+    atomic_store_explicit(&L->id,id,memory_order_release);
+    return id;
+}
+
+static void lat_stamp(int id,int stage){
+    if(id==LAT_NONE) return;
+    LatTrace* L=&lat_ring[id%LAT_RING];
+    if(atomic_load_explicit(&L->id,memory_order_acquire)==id) // not recycled
+        atomic_store_explicit(&L->t[stage],lat_now_ns(),memory_order_relaxed);
+}
+
+// after a swap: every press traced so far is on screen
+static void lat_presented(void){
+    for(;lat_unpresented!=lat_next;lat_unpresented=(lat_unpresented+1)&0x7fffffff)
+        lat_stamp(lat_unpresented,LAT_PRESENTED);
+}
+
+static int lat_cmp(const void* a,const void* b){
+    double x=*(const double*)a, y=*(const double*)b;
+    return (x>y)-(x<y);
+}
+
+static void lat_dump(void){
+    static const char* name[]={"event>hit","hit>sent","sent>flush","hit>present","event>flush","event>present"};
+    static double v[6][LAT_RING];
+    int n[6]={0};
+    for(int i=0;i<LAT_RING;i++){
+        LatTrace* L=&lat_ring[i];
+        if(atomic_load(&L->id)==LAT_NONE) continue;
+        double t[LAT_STAMPS];
+        for(int k=0;k<LAT_STAMPS;k++) t[k]=atomic_load(&L->t[k])/1e3;
+        double lag=L->event_lag_us;
+        if(!t[LAT_HIT]) continue;
+        if(lag>=0) v[0][n[0]++]=lag;
+        if(t[LAT_SENT]) v[1][n[1]++]=t[LAT_SENT]-t[LAT_HIT];
+        if(t[LAT_SENT]&&t[LAT_FLUSHED]) v[2][n[2]++]=t[LAT_FLUSHED]-t[LAT_SENT];
+        if(t[LAT_PRESENTED]) v[3][n[3]++]=t[LAT_PRESENTED]-t[LAT_HIT];
+        if(lag>=0&&t[LAT_FLUSHED]) v[4][n[4]++]=lag+t[LAT_FLUSHED]-t[LAT_HIT];
+        if(lag>=0&&t[LAT_PRESENTED]) v[5][n[5]++]=lag+t[LAT_PRESENTED]-t[LAT_HIT];
+    }
+    fprintf(stderr,"key latency (us, last %d presses):\n",LAT_RING);
+    for(int s=0;s<6;s++){
+        if(!n[s]) continue;
+        qsort(v[s],n[s],sizeof(double),lat_cmp);
+        fprintf(stderr,"  %-13s n=%d p50=%.0f p99=%.0f max=%.0f\n",name[s],n[s],
+                v[s][n[s]/2],v[s][(int)(n[s]*0.99)],v[s][n[s]-1]);
+    }
+}
+
+/* Utility for ms timestamp */
+static long now_ms(){struct timespec ts;clock_gettime(CLOCK_MONOTONIC,&ts);return ts.tv_sec*1000+ts.tv_nsec/1000000;}
+
+/* Main-loop wakeups: the X connection, a timerfd armed to the next key
+   repeat deadline, and an eventfd for internal wakeups (signals for now).
+   Nothing else wakes the process. */
+static int repeat_tfd=-1, wake_fd=-1;
+
+static void loop_init(void){
+    repeat_tfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+    wake_fd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if(repeat_tfd<0||wake_fd<0) perror("timerfd/eventfd");
+}
+
+// async-signal-safe
+static void loop_wake(void){
+    uint64_t one=1;
+    if(wake_fd>=0){ ssize_t r=write(wake_fd,&one,sizeof(one)); (void)r; }
+}
+
+// deadline is a now_ms() value; <0 disarms
+static void repeat_timer_arm(long deadline_ms){
+    struct itimerspec its={0};
+    if(repeat_tfd<0) return;
+    if(deadline_ms>=0){
+        its.it_value.tv_sec=deadline_ms/1000;
+        its.it_value.tv_nsec=(deadline_ms%1000)*1000000L+1; // never all-zero (= disarm)
+    }
+    timerfd_settime(repeat_tfd,TFD_TIMER_ABSTIME,&its,NULL);
+}
+
+/* Flush our requests and sleep until something needs handling.
+   timeout_ms<0 waits indefinitely. */
+static void loop_wait(Display* dpy,long repeat_deadline,int timeout_ms){
+    XFlush(dpy);
+    if(XPending(dpy)) return;
+    if(repeat_tfd<0 && repeat_deadline>=0){ // no timerfd: fold the deadline into the timeout
+        long dt=repeat_deadline-now_ms();
+        if(dt<0) dt=0;
+        if(timeout_ms<0||dt<timeout_ms) timeout_ms=(int)dt;
+    }
+    struct pollfd pfd[3]={
+        {ConnectionNumber(dpy),POLLIN,0},
+        {repeat_tfd,POLLIN,0},  // poll() skips negative fds
+        {wake_fd,POLLIN,0},
+    };
+    if(poll(pfd,3,timeout_ms)<=0) return; // EINTR: the caller checks the signal flags
+    uint64_t v; ssize_t r;
+    if(pfd[1].revents&POLLIN){ r=read(repeat_tfd,&v,sizeof(v)); (void)r; }
+    if(pfd[2].revents&POLLIN){ r=read(wake_fd,&v,sizeof(v)); (void)r; }
+}
+
+static void prof_on_sigusr1(int sig){ (void)sig; prof_dump_requested=1; loop_wake(); }
+static void on_terminate(int sig){ (void)sig; quit_requested=1; loop_wake(); } // exit() from the loop runs atexit
+
 /* Rect shaders */
 static const char* RECT_VS="attribute vec2 aPos;attribute vec3 aCol;varying vec3 vCol;uniform vec2 uRes;void main(){vec2 ndc=(aPos/uRes)*2.0-1.0;gl_Position=vec4(ndc.x,-ndc.y,0.0,1.0);vCol=aCol;}";
 static const char* RECT_FS="precision mediump float;varying vec3 vCol;void main(){gl_FragColor=vec4(vCol,1.0);}";
@@ -75,159 +394,645 @@ static const char* RECT_FS="precision mediump float;varying vec3 vCol;void main(
 static GLuint rect_prog; static GLint rect_aPos,rect_aCol,rect_uRes;
 typedef struct { float x,y,r,g,b; } RectVtx;
 
+/* Batched rectangles: quads are collected on the CPU and uploaded into a
+   single VBO, then drawn with one glDrawArrays per flush. */
+static RectVtx* rect_batch=NULL;
+static int rect_batch_n=0, rect_batch_cap=0;
+static GLuint rect_vbo=0;
+
+static void rect_batch_vtx(float x,float y,float r,float g,float b){
+    if(rect_batch_n==rect_batch_cap){
+        int cap=rect_batch_cap?rect_batch_cap*2:1024;
+        RectVtx* nb=realloc(rect_batch,cap*sizeof(RectVtx));
+        if(!nb) return;
+        rect_batch=nb; rect_batch_cap=cap;
+    }
+    rect_batch[rect_batch_n++]=(RectVtx){x,y,r,g,b};
+}
+
+static void rect_batch_quad(float x,float y,float w,float h,float r,float g,float b){
+    rect_batch_vtx(x,y,r,g,b);   rect_batch_vtx(x+w,y,r,g,b);   rect_batch_vtx(x+w,y+h,r,g,b);
+    rect_batch_vtx(x,y,r,g,b);   rect_batch_vtx(x+w,y+h,r,g,b); rect_batch_vtx(x,y+h,r,g,b);
+}
+
+static void rect_batch_flush(int win_w,int win_h){
+    if(rect_batch_n==0) return;
+    if(!rect_vbo) glGenBuffers(1,&rect_vbo);
+    glUseProgram(rect_prog);
+    glUniform2f(rect_uRes,(float)win_w,(float)win_h);
+    glBindBuffer(GL_ARRAY_BUFFER,rect_vbo);
+    glBufferData(GL_ARRAY_BUFFER,rect_batch_n*sizeof(RectVtx),rect_batch,GL_STREAM_DRAW);
+    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(RectVtx),(void*)0);
+    glEnableVertexAttribArray(rect_aPos);
+    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),(void*)(2*sizeof(float)));
+    glEnableVertexAttribArray(rect_aCol);
+    draw_arrays(GL_TRIANGLES,0,rect_batch_n);
+    glBindBuffer(GL_ARRAY_BUFFER,0); // icons/menu still draw from client-side arrays
+    rect_batch_n=0;
+}
+
 /* Text shaders */
-static const char* TEXT_VS="attribute vec2 aPos;attribute vec2 aUV;varying vec2 vUV;uniform vec2 uRes;void main(){vec2 ndc=(aPos/uRes)*2.0-1.0;gl_Position=vec4(ndc.x,-ndc.y,0.0,1.0);vUV=aUV;}";
+static const char* TEXT_VS="attribute vec2 aPos;attribute vec2 aUV;attribute vec3 aCol;varying vec2 vUV;varying vec3 vCol;uniform vec2 uRes;void main(){vec2 ndc=(aPos/uRes)*2.0-1.0;gl_Position=vec4(ndc.x,-ndc.y,0.0,1.0);vUV=aUV;vCol=aCol;}";
 //static const char* TEXT_FS="precision mediump float;varying vec2 vUV;uniform sampler2D uFont;void main(){float a=texture2D(uFont,vUV).a;gl_FragColor=vec4(1.0,1.0,1.0,a);}";
 
 static const char* TEXT_FS =
 "precision mediump float;"
 "varying vec2 vUV;"
+"varying vec3 vCol;"
 "uniform sampler2D uFont;"
-"uniform vec3 uColor;"
 "void main(){"
 " float a = texture2D(uFont,vUV).a;"
-" gl_FragColor = vec4(uColor, a);"
+" gl_FragColor = vec4(vCol, a);"
 "}";
 
-static GLint text_uColor;
-static GLuint text_prog; static GLint text_aPos,text_aUV,text_uRes,text_uFont;
-static GLuint fontTex;
-static stbtt_bakedchar cdata[96]; // ASCII 32..126
+/* SDF atlas: alpha holds distance to the outline, 0.5 on the edge.
+   fwidth() keeps the edge about one screen pixel wide at any scale. */
+static const char* TEXT_FS_SDF =
+"#extension GL_OES_standard_derivatives : enable\n"
+"precision mediump float;"
+"varying vec2 vUV;"
+"varying vec3 vCol;"
+"uniform sampler2D uFont;"
+"void main(){"
+" float d = texture2D(uFont,vUV).a;"
+" float w = max(fwidth(d), 0.02);"
+" gl_FragColor = vec4(vCol, smoothstep(0.5-w, 0.5+w, d));"
+"}";
+
+static GLuint text_prog; static GLint text_aPos,text_aUV,text_aCol,text_uRes,text_uFont;
+static bool font_sdf=false;       // glyphs are rasterised as signed distance fields
+
+#define FONT_PX  28.0f // atlas glyph height; labels scale relative to this
+#define SDF_PAD  6     // SDF spread in atlas pixels around each glyph
+
+/* Glyph cache. Glyphs are rasterised on demand, keyed by Unicode
+   codepoint, into fixed-size cells of a few 512x512 atlas pages.
+   Lookups go through a small chained hash table. When every cell is
+   taken, the least recently used glyph is evicted, and its cell is
+   rewritten with glTexSubImage2D. ASCII is preloaded at startup. */
+#define GLYPH_CELL      48                          // cell size in pixels, 1px border kept clear
+#define GLYPH_PAGE      512
+#define GLYPH_PER_ROW   (GLYPH_PAGE/GLYPH_CELL)
+#define GLYPH_PER_PAGE  (GLYPH_PER_ROW*GLYPH_PER_ROW)
+#define GLYPH_PAGES     4
+#define GLYPH_SLOTS     (GLYPH_PAGES*GLYPH_PER_PAGE)
+#define GLYPH_BUCKETS   512                         // power of two
+
+typedef struct {
+    unsigned int cp;          // codepoint; 0 = free cell
+    float xoff,yoff,xadvance; // at FONT_PX
+    unsigned short w,h;       // bitmap size inside the cell (0 = blank glyph)
+    short chain;              // next slot in the same hash bucket
+    short prev,next;          // LRU list, head = most recently used
+    unsigned int pass;        // text pass that last used it
+} Glyph;
+
+static stbtt_fontinfo font_info;
+static float font_scale;
+static GLuint glyph_tex[GLYPH_PAGES];
+static Glyph glyphs[GLYPH_SLOTS];
+static short glyph_bucket[GLYPH_BUCKETS];
+static short glyph_lru_head=-1, glyph_lru_tail=-1;
+static int glyph_used=0;
+static unsigned int text_pass=1; // bumped by every text_batch_flush
+
+/* Decode one UTF-8 sequence; malformed input yields U+FFFD */
+static unsigned int utf8_next(const char** ps){
+    const unsigned char* p=(const unsigned char*)*ps;
+    unsigned int c=*p++, n=0;
+    if(c<0x80)               n=0;
+    else if((c&0xE0)==0xC0){ n=1; c&=0x1F; }
+    else if((c&0xF0)==0xE0){ n=2; c&=0x0F; }
+    else if((c&0xF8)==0xF0){ n=3; c&=0x07; }
+    else { *ps=(const char*)p; return 0xFFFD; }
+    for(unsigned int i=0;i<n;i++){
+        if((*p&0xC0)!=0x80){ *ps=(const char*)p; return 0xFFFD; }
+        c=(c<<6)|(*p++&0x3F);
+    }
+    *ps=(const char*)p;
+    return c;
+}
+
+static void glyph_lru_unlink(int s){
+    Glyph* g=&glyphs[s];
+    if(g->prev>=0) glyphs[g->prev].next=g->next; else glyph_lru_head=g->next;
+    if(g->next>=0) glyphs[g->next].prev=g->prev; else glyph_lru_tail=g->prev;
+    g->prev=g->next=-1;
+}
+
+static void glyph_lru_push_front(int s){
+    Glyph* g=&glyphs[s];
+    g->prev=-1; g->next=glyph_lru_head;
+    if(glyph_lru_head>=0) glyphs[glyph_lru_head].prev=(short)s;
+    glyph_lru_head=(short)s;
+    if(glyph_lru_tail<0) glyph_lru_tail=(short)s;
+}
+
+static void glyph_hash_remove(int s){
+    short* link=&glyph_bucket[glyphs[s].cp&(GLYPH_BUCKETS-1)];
+    while(*link>=0 && *link!=s) link=&glyphs[*link].chain;
+    if(*link==s) *link=glyphs[s].chain;
+}
+
+/* Rasterise cp into cell s and upload just that cell */
+static void glyph_raster(int s,unsigned int cp){
+    static unsigned char cell[GLYPH_CELL*GLYPH_CELL];
+    Glyph* g=&glyphs[s];
+    int adv,lsb,w=0,h=0,xo=0,yo=0;
+    unsigned char* bm=NULL;
+
+    memset(cell,0,sizeof(cell));
+    g->w=g->h=0; g->xoff=g->yoff=g->xadvance=0.0f;
+    if(stbtt_FindGlyphIndex(&font_info,(int)cp)){ // missing glyphs stay blank
+        stbtt_GetCodepointHMetrics(&font_info,(int)cp,&adv,&lsb);
+        g->xadvance=adv*font_scale;
+        if(font_sdf)
+            bm=stbtt_GetCodepointSDF(&font_info,font_scale,(int)cp,SDF_PAD,128,128.0f/SDF_PAD,&w,&h,&xo,&yo);
+        else
+            bm=stbtt_GetCodepointBitmap(&font_info,0,font_scale,(int)cp,&w,&h,&xo,&yo);
+    }
+    if(bm){
+        int cw=w<GLYPH_CELL-2?w:GLYPH_CELL-2, ch=h<GLYPH_CELL-2?h:GLYPH_CELL-2;
+        for(int r=0;r<ch;r++) memcpy(&cell[(r+1)*GLYPH_CELL+1],&bm[r*w],cw);
+        g->w=(unsigned short)cw; g->h=(unsigned short)ch;
+        g->xoff=(float)xo; g->yoff=(float)yo;
+        if(font_sdf) stbtt_FreeSDF(bm,NULL); else stbtt_FreeBitmap(bm,NULL);
+    }
+
+    int page=s/GLYPH_PER_PAGE, c=s%GLYPH_PER_PAGE;
+    if(!glyph_tex[page]){
+        glGenTextures(1,&glyph_tex[page]);
+        glBindTexture(GL_TEXTURE_2D,glyph_tex[page]);
+        glTexImage2D(GL_TEXTURE_2D,0,GL_ALPHA,GLYPH_PAGE,GLYPH_PAGE,0,GL_ALPHA,GL_UNSIGNED_BYTE,NULL);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+    } else {
+        glBindTexture(GL_TEXTURE_2D,glyph_tex[page]);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+    glTexSubImage2D(GL_TEXTURE_2D,0,(c%GLYPH_PER_ROW)*GLYPH_CELL,(c/GLYPH_PER_ROW)*GLYPH_CELL,
+                    GLYPH_CELL,GLYPH_CELL,GL_ALPHA,GL_UNSIGNED_BYTE,cell);
+}
+
+/* Slot of cp, rasterising it if needed; -1 if the cache can't take it */
+static int glyph_get(unsigned int cp){
+    int b=cp&(GLYPH_BUCKETS-1);
+    for(int s=glyph_bucket[b];s>=0;s=glyphs[s].chain){
+        if(glyphs[s].cp!=cp) continue;
+        if(s!=glyph_lru_head){ glyph_lru_unlink(s); glyph_lru_push_front(s); }
+        glyphs[s].pass=text_pass;
+        return s;
+    }
+
+    int s;
+    if(glyph_used<GLYPH_SLOTS){
+        s=glyph_used++;
+    } else {
+        s=glyph_lru_tail;
+        // Every cell is queued in the current pass: can't evict safely
+        if(s<0||glyphs[s].pass==text_pass) return -1;
+        glyph_hash_remove(s);
+        glyph_lru_unlink(s);
+    }
+    glyph_raster(s,cp);
+    glyphs[s].cp=cp;
+    glyphs[s].pass=text_pass;
+    glyphs[s].chain=glyph_bucket[b];
+    glyph_bucket[b]=(short)s;
+    glyph_lru_push_front(s);
+    return s;
+}
 
 float text_width(const char* s,float scale){
     float w=0.0f;
-    for(const char* p=s;*p;p++){
-        if(*p<32||*p>=128) continue;
-        w+=cdata[*p-32].xadvance*scale;
+    for(const char* p=s;*p;){
+        unsigned int cp=utf8_next(&p);
+        if(cp<32) continue;
+        int g=glyph_get(cp);
+        if(g>=0) w+=glyphs[g].xadvance*scale;
     }
     return w;
 }
 
-/* Draw rectangles */
-static void draw_keys(int width,int height,Key*keys,int n,int pressed[],int caps_down){
-    glUseProgram(rect_prog);
-    glUniform2f(rect_uRes,(float)width,(float)height);
-    for(int i=0;i<n;i++){
-        float x=keys[i].x,y=keys[i].y,w=keys[i].w,h=keys[i].h;
-        float r=0.3f,g=0.3f,b=0.3f;
-        int is_pressed = pressed[i];
-        if (keys[i].keysym == XK_Caps_Lock && caps_down) is_pressed = 1;
-	if (keys[i].keysym == XK_Mode_switch && fn_down) is_pressed = 1;
-        if(is_pressed){ r*=0.5f; g*=0.5f; b*=0.5f; }
-        RectVtx quad[6]={{x,y,r,g,b},{x+w,y,r,g,b},{x+w,y+h,r,g,b},
-                         {x,y,r,g,b},{x+w,y+h,r,g,b},{x,y+h,r,g,b}};
-        glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&quad[0].x);
-        glEnableVertexAttribArray(rect_aPos);
-        glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&quad[0].r);
-        glEnableVertexAttribArray(rect_aCol);
-        glDrawArrays(GL_TRIANGLES,0,6);
-    }
-}
-
-/* Draw text with stb_truetype */
-static void draw_text(const char* str,float x,float y,float scale,int win_w,int win_h){
+/* Batched glyphs: every glyph quad of a pass goes into one vertex buffer
+   per atlas page (colour per vertex) and is drawn with a single indexed
+   draw per page that is in use. The index buffer is static, so 16-bit
+   indices cap a page at 16384 glyphs per pass. */
+#define TEXT_BATCH_MAX_QUADS 16384
+typedef struct { float x,y,u,v,r,g,b; } TextVtx;
+typedef struct { TextVtx* v; int quads,cap; } TextBatch; // quads/cap count quads
+
+static TextBatch text_batch[GLYPH_PAGES];
+static GLuint text_vbo=0, text_ibo=0;
+
+static void text_batch_quad(int page,float x0,float y0,float x1,float y1,
+                            float u0,float v0,float u1,float v1,
+                            float r,float g,float b){
+    TextBatch* tb=&text_batch[page];
+    if(tb->quads==TEXT_BATCH_MAX_QUADS) return;
+    if(tb->quads==tb->cap){
+        int cap=tb->cap?tb->cap*2:256;
+        TextVtx* nb=realloc(tb->v,cap*4*sizeof(TextVtx));
+        if(!nb) return;
+        tb->v=nb; tb->cap=cap;
+    }
+    TextVtx* v=&tb->v[tb->quads*4];
+    v[0]=(TextVtx){x0,y0,u0,v0,r,g,b};
+    v[1]=(TextVtx){x1,y0,u1,v0,r,g,b};
+    v[2]=(TextVtx){x1,y1,u1,v1,r,g,b};
+    v[3]=(TextVtx){x0,y1,u0,v1,r,g,b};
+    tb->quads++;
+}
+
+static void text_batch_flush(int win_w,int win_h){
+    int total=0;
+    for(int p=0;p<GLYPH_PAGES;p++) total+=text_batch[p].quads;
+    text_pass++;
+    if(total==0) return;
+    if(!text_vbo){
+        GLushort* idx=malloc(TEXT_BATCH_MAX_QUADS*6*sizeof(GLushort));
+        if(!idx){ for(int p=0;p<GLYPH_PAGES;p++) text_batch[p].quads=0; return; }
+        for(int q=0;q<TEXT_BATCH_MAX_QUADS;q++){
+            GLushort v=(GLushort)(q*4);
+            idx[q*6+0]=v; idx[q*6+1]=v+1; idx[q*6+2]=v+2;
+            idx[q*6+3]=v; idx[q*6+4]=v+2; idx[q*6+5]=v+3;
+        }
+        glGenBuffers(1,&text_vbo);
+        glGenBuffers(1,&text_ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,text_ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER,TEXT_BATCH_MAX_QUADS*6*sizeof(GLushort),idx,GL_STATIC_DRAW);
+        free(idx);
+    }
     glUseProgram(text_prog);
     glUniform2f(text_uRes,(float)win_w,(float)win_h);
     glUniform1i(text_uFont,0);
-    glBindTexture(GL_TEXTURE_2D,fontTex);
-
-    float xpos=x;
-    for(const char* p=str;*p;p++){
-        if(*p<32||*p>=128) continue;
-        stbtt_bakedchar* b=&cdata[*p-32];
-        float x0=xpos+b->xoff*scale;
-        float y0=y+b->yoff*scale;
-        float x1=x0+(b->x1-b->x0)*scale;
-        float y1=y0+(b->y1-b->y0)*scale;
-        float u0=b->x0/512.0f, v0=b->y0/512.0f;
-        float u1=b->x1/512.0f, v1=b->y1/512.0f;
-
-        GLfloat verts[16]={
-            x0,y0,u0,v0,
-            x1,y0,u1,v0,
-            x1,y1,u1,v1,
-            x0,y1,u0,v1
-        };
-        glVertexAttribPointer(text_aPos,2,GL_FLOAT,GL_FALSE,4*sizeof(GLfloat),verts);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,text_ibo);
+
+    for(int p=0;p<GLYPH_PAGES;p++){
+        TextBatch* tb=&text_batch[p];
+        if(tb->quads==0) continue;
+        glBindTexture(GL_TEXTURE_2D,glyph_tex[p]);
+        glBindBuffer(GL_ARRAY_BUFFER,text_vbo);
+        glBufferData(GL_ARRAY_BUFFER,tb->quads*4*sizeof(TextVtx),tb->v,GL_STREAM_DRAW);
+        glVertexAttribPointer(text_aPos,2,GL_FLOAT,GL_FALSE,sizeof(TextVtx),(void*)0);
         glEnableVertexAttribArray(text_aPos);
-        glVertexAttribPointer(text_aUV,2,GL_FLOAT,GL_FALSE,4*sizeof(GLfloat),verts+2);
+        glVertexAttribPointer(text_aUV,2,GL_FLOAT,GL_FALSE,sizeof(TextVtx),(void*)(2*sizeof(float)));
         glEnableVertexAttribArray(text_aUV);
-        glDrawArrays(GL_TRIANGLE_FAN,0,4);
-        xpos+=b->xadvance*scale;
+        glVertexAttribPointer(text_aCol,3,GL_FLOAT,GL_FALSE,sizeof(TextVtx),(void*)(4*sizeof(float)));
+        glEnableVertexAttribArray(text_aCol);
+        draw_elements(GL_TRIANGLES,tb->quads*6,GL_UNSIGNED_SHORT,0);
+        tb->quads=0;
     }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
 }
 
-static void draw_text_colored(const char* str,float x,float y,float scale,
-                              int win_w,int win_h,float r,float g,float b){
-    glUseProgram(text_prog);
-    glUniform2f(text_uRes,(float)win_w,(float)win_h);
-    glUniform1i(text_uFont,0);
-    glUniform3f(text_uColor,r,g,b);
-    glBindTexture(GL_TEXTURE_2D,fontTex);
+/* Key geometry lives on the GPU: positions are uploaded once per layout,
+   colours sit in a second buffer so a state change only rewrites the
+   vertices of the key that changed. Each key owns one contiguous range:
+   its face quad followed by its icon strokes (arrows, gear, Backspace),
+   which are tessellated here once instead of on every frame. */
+typedef struct { GLubyte r,g,b,a; } KeyCol; // a: 255 = pressed face (key-cap shader)
+
+/* Key-cap shader: each face quad carries its offset from the key centre,
+   half-size and corner radius, so rounded corners, a 1px border and the
+   pressed inset shadow come out of the fragment shader with no extra
+   vertices. Icon strokes have radius < 0 and are drawn flat. */
+static const char* KEY_VS=
+"attribute vec2 aPos;attribute vec4 aCol;attribute vec2 aLocal;attribute vec3 aShape;"
+"varying vec4 vCol;varying vec2 vLocal;varying vec3 vShape;uniform vec2 uRes;"
+"void main(){vec2 ndc=(aPos/uRes)*2.0-1.0;gl_Position=vec4(ndc.x,-ndc.y,0.0,1.0);"
+"vCol=aCol;vLocal=aLocal;vShape=aShape;}";
+static const char* KEY_FS=
+"precision mediump float;"
+"varying vec4 vCol;varying vec2 vLocal;varying vec3 vShape;"
+"void main(){"
+" if(vShape.z<0.0){ gl_FragColor=vec4(vCol.rgb,1.0); return; }"
+" vec2 q=abs(vLocal)-vShape.xy+vShape.z;"
+" float d=length(max(q,0.0))+min(max(q.x,q.y),0.0)-vShape.z;" // <0 inside the cap
+" vec3 c=vCol.rgb;"
+" c=mix(c,c*0.6,clamp(2.0+d,0.0,1.0));"                  // 1px darker rim
+" c*=1.0-vCol.a*0.4*(1.0-clamp(-d/5.0,0.0,1.0));"         // inset shadow when pressed
+" gl_FragColor=vec4(c,clamp(0.5-d,0.0,1.0));"
+"}";
+static GLuint key_prog; static GLint key_aPos,key_aCol,key_aLocal,key_aShape,key_uRes;
 
-    float xpos=x;
-    for(const char* p=str;*p;p++){
-        if(*p<32||*p>=128) continue;
-        stbtt_bakedchar* bch=&cdata[*p-32];
-        float x0=xpos+bch->xoff*scale;
-        float y0=y+bch->yoff*scale;
-        float x1=x0+(bch->x1-bch->x0)*scale;
-        float y1=y0+(bch->y1-bch->y0)*scale;
-        float u0=bch->x0/512.0f, v0=bch->y0/512.0f;
-        float u1=bch->x1/512.0f, v1=bch->y1/512.0f;
-
-        GLfloat verts[16]={
-            x0,y0,u0,v0,
-            x1,y0,u1,v0,
-            x1,y1,u1,v1,
-            x0,y1,u0,v1
-        };
-        glVertexAttribPointer(text_aPos,2,GL_FLOAT,GL_FALSE,4*sizeof(GLfloat),verts);
-        glEnableVertexAttribArray(text_aPos);
-        glVertexAttribPointer(text_aUV,2,GL_FLOAT,GL_FALSE,4*sizeof(GLfloat),verts+2);
-        glEnableVertexAttribArray(text_aUV);
-        glDrawArrays(GL_TRIANGLE_FAN,0,4);
-        xpos+=bch->xadvance*scale;
+#define KEY_CAP_RADIUS 6.0f
+#define KEY_VTX_FLOATS 7 // x,y, local x,y, half w,h, radius
+
+static GLuint key_pos_vbo=0, key_col_vbo=0;
+static int key_geom_n=0, key_geom_layers=0; // keys per layer, layers
+static int* key_geom_first=NULL;          // first vertex of record layer*n+i
+static int* key_geom_count=NULL;          // vertices of record layer*n+i
+static KeyCol* key_geom_col[2]={NULL,NULL}; // per-vertex colour released/pressed
+static signed char* key_geom_state=NULL;  // last uploaded pressed state, -1 = unknown
+
+static KeyCol grey_col(float v,GLubyte a){
+    GLubyte c=(GLubyte)(v*255.0f+0.5f);
+    return (KeyCol){c,c,c,a};
+}
+
+/* shape: cap centre, half-size and radius applied to following vertices */
+typedef struct { float* pos; KeyCol* col[2]; int n,cap; float shape[5]; } MeshBuild;
+
+static void mesh_shape_cap(MeshBuild* m,float x,float y,float w,float h){
+    float hw=w*0.5f, hh=h*0.5f;
+    float r=KEY_CAP_RADIUS;
+    if(r>hw) r=hw;
+    if(r>hh) r=hh;
+    float sh[5]={x+hw,y+hh,hw,hh,r};
+    memcpy(m->shape,sh,sizeof(sh));
+}
+
+static void mesh_shape_flat(MeshBuild* m){
+    float sh[5]={0,0,0,0,-1.0f};
+    memcpy(m->shape,sh,sizeof(sh));
+}
+
+static void mesh_vtx(MeshBuild* m,float x,float y,float up,float down){
+    if(m->n==m->cap){
+        int cap=m->cap?m->cap*2:1024;
+        float* np=realloc(m->pos,cap*KEY_VTX_FLOATS*sizeof(float));
+        if(np) m->pos=np;
+        KeyCol* nu=realloc(m->col[0],cap*sizeof(KeyCol));
+        if(nu) m->col[0]=nu;
+        KeyCol* nd=realloc(m->col[1],cap*sizeof(KeyCol));
+        if(nd) m->col[1]=nd;
+        if(!np||!nu||!nd) return;
+        m->cap=cap;
     }
+    float* p=&m->pos[m->n*KEY_VTX_FLOATS];
+    bool cap=m->shape[4]>=0.0f;
+    p[0]=x; p[1]=y;
+    p[2]=x-m->shape[0]; p[3]=y-m->shape[1];
+    p[4]=m->shape[2]; p[5]=m->shape[3]; p[6]=m->shape[4];
+    m->col[0][m->n]=grey_col(up,0);
+    m->col[1][m->n]=grey_col(down,cap?255:0);
+    m->n++;
 }
 
-static void draw_key_labels(Key* K, int win_w, int win_h, int shift_down, int caps_down) {
-    float white[3] = {1.0f,1.0f,1.0f};
-    float grey[3]  = {0.7f,0.7f,0.7f};
+static void mesh_tri(MeshBuild* m,float x0,float y0,float x1,float y1,float x2,float y2,
+                     float up,float down){
+    mesh_vtx(m,x0,y0,up,down); mesh_vtx(m,x1,y1,up,down); mesh_vtx(m,x2,y2,up,down);
+}
 
-    // Helper: is this a letter key (exactly one alphabetic character)?
-    bool is_letter = (strlen(K->label) == 1) && isalpha((unsigned char)K->label[0]);
+static void mesh_rect(MeshBuild* m,float x,float y,float w,float h,float up,float down){
+    mesh_tri(m,x,y,x+w,y,x+w,y+h,up,down);
+    mesh_tri(m,x,y,x+w,y+h,x,y+h,up,down);
+}
+
+/* Up/down chevron: two arms meeting at (cx,cy+dir*hsize) */
+static void mesh_chevron_v(MeshBuild* m,float cx,float cy,float dir){
+    const float wsize=13.0f, hsize=5.0f, s=2.0f; // half-span, height, stroke
+    float by=cy-dir*hsize, ty=cy+dir*hsize;
+    mesh_tri(m,cx-wsize,by,cx-wsize+s,by,cx,ty,1.0f,0.75f);
+    mesh_tri(m,cx-wsize,by,cx,ty,cx-s,ty,1.0f,0.75f);
+    mesh_tri(m,cx+wsize,by,cx+wsize-s,by,cx,ty,1.0f,0.75f);
+    mesh_tri(m,cx+wsize,by,cx,ty,cx+s,ty,1.0f,0.75f);
+}
+
+/* Left/right chevron: tip at (cx+dir*hsize,cy) */
+static void mesh_chevron_h(MeshBuild* m,float cx,float cy,float dir){
+    const float wsize=2.0f, hsize=10.0f, s=2.0f;
+    float bx=cx-dir*wsize, tx=cx+dir*hsize;
+    mesh_tri(m,bx,cy-hsize,bx,cy-hsize+s,tx,cy,1.0f,0.75f);
+    mesh_tri(m,bx,cy-hsize,tx,cy,tx,cy-s,1.0f,0.75f);
+    mesh_tri(m,bx,cy+hsize,bx,cy+hsize-s,tx,cy,1.0f,0.75f);
+    mesh_tri(m,bx,cy+hsize,tx,cy,tx,cy+s,1.0f,0.75f);
+}
+
+/* Preferences gear: 8 teeth, an outlined ring and a punched-out hole */
+static void mesh_gear(MeshBuild* m,const Key* K){
+    float cx = K->x + 14.0f, cy = K->y + 14.0f;
+    float outer_r = K->h * 0.18f;   // outer radius
+    float inner_r = K->h * 0.10f;   // inner hole radius
+    float stroke = 2.0f;            // outline thickness
+    const int teeth = 8, segs = 24;
+    const float up = 0.0f, down = 0.3f; // black, dark grey when pressed
+
+    for(int t=0;t<teeth;t++){
+        float a = 2*M_PI*t/teeth, ca = cosf(a), sa = sinf(a);
+        float tx0 = cx+(outer_r-stroke)*ca, ty0 = cy+(outer_r-stroke)*sa;
+        float tx1 = cx+(outer_r+stroke*2)*ca, ty1 = cy+(outer_r+stroke*2)*sa;
+        float w2 = stroke;
+        mesh_tri(m,tx0-w2*sa,ty0+w2*ca, tx1-w2*sa,ty1+w2*ca, tx1+w2*sa,ty1-w2*ca, up,down);
+        mesh_tri(m,tx0-w2*sa,ty0+w2*ca, tx1+w2*sa,ty1-w2*ca, tx0+w2*sa,ty0-w2*ca, up,down);
+    }
+    for(int k=0;k<segs;k++){
+        float a0 = 2*M_PI*k/segs, a1 = 2*M_PI*(k+1)/segs;
+        float c0 = cosf(a0), s0 = sinf(a0), c1 = cosf(a1), s1 = sinf(a1);
+        float ri = outer_r-stroke, ro = outer_r+stroke;
+        mesh_tri(m,cx+ri*c0,cy+ri*s0, cx+ro*c0,cy+ro*s0, cx+ro*c1,cy+ro*s1, up,down);
+        mesh_tri(m,cx+ri*c0,cy+ri*s0, cx+ro*c1,cy+ro*s1, cx+ri*c1,cy+ri*s1, up,down);
+    }
+    for(int k=0;k<segs;k++){
+        float a0 = 2*M_PI*k/segs, a1 = 2*M_PI*(k+1)/segs;
+        mesh_tri(m,cx,cy, cx+inner_r*cosf(a0),cy+inner_r*sinf(a0),
+                 cx+inner_r*cosf(a1),cy+inner_r*sinf(a1), 0.2f,0.2f);
+    }
+}
+
+/* Backspace outline box, sized from the 'X' glyph it frames */
+static void backspace_box(const Key* K,float* cx,float* cy,float* box_w,float* box_h,float* scale){
+    *scale = fmaxf(0.6f,(K->h*0.5f)/32.0f);
+    float tw  = text_width("X", *scale);
+    float th  = *scale * 20.0f; // approx glyph height
+    float pad = 1.0f;
+    *box_w = tw + pad*2;
+    *box_h = th + pad*2 - 2.0f; // 2px shorter vertically
+    *cx = K->x + 10.0f;         // top-left inside key
+    *cy = K->y + 4.0f;
+}
+
+static void mesh_backspace(MeshBuild* m,const Key* K){
+    float cx,cy,box_w,box_h,scale;
+    backspace_box(K,&cx,&cy,&box_w,&box_h,&scale);
+    float s = 1.0f; // stroke thickness
+
+    mesh_rect(m,cx,cy,box_w,s,1.0f,0.75f);                 // top
+    mesh_rect(m,cx,cy+box_h-s,box_w,s,1.0f,0.75f);         // bottom
+    mesh_rect(m,cx+box_w-s,cy,s,box_h,1.0f,0.75f);         // right
+
+    // Left chevron strokes — tip further left for steeper angle
+    float tip_x = cx - box_w * 0.6f;
+    float tip_y = cy + box_h * 0.5f;
+    mesh_tri(m,tip_x,tip_y, cx,cy, cx,cy+s, 1.0f,0.75f);
+    mesh_tri(m,tip_x,tip_y, cx,cy+s, tip_x+s,tip_y, 1.0f,0.75f);
+    mesh_tri(m,tip_x,tip_y, cx,cy+box_h-s, cx,cy+box_h, 1.0f,0.75f);
+    mesh_tri(m,tip_x,tip_y, cx,cy+box_h, tip_x+s,tip_y, 1.0f,0.75f);
+}
 
-if (fn_down) {
+static void mesh_key_icon(MeshBuild* m,const Key* K){
     switch (K->keysym) {
-        case XK_1:  draw_text_colored("F1",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_2:  draw_text_colored("F2",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_3:  draw_text_colored("F3",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_4:  draw_text_colored("F4",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_5:  draw_text_colored("F5",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_6:  draw_text_colored("F6",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_7:  draw_text_colored("F7",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_8:  draw_text_colored("F8",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_9:  draw_text_colored("F9",  K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_0:  draw_text_colored("F10", K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_minus: draw_text_colored("F11", K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
-        case XK_equal: draw_text_colored("F12", K->x+4, K->y+24, 0.8f, win_w, win_h, 1,1,1); return;
+        case XK_Up:          mesh_chevron_v(m, K->x+18.0f, K->y+10.0f, -1.0f); break;
+        case XK_Down:        mesh_chevron_v(m, K->x+18.0f, K->y+16.0f,  1.0f); break;
+        case XK_Left:        mesh_chevron_h(m, K->x+18.0f, K->y+12.0f, -1.0f); break;
+        case XK_Right:       mesh_chevron_h(m, K->x+12.0f, K->y+12.0f,  1.0f); break;
+        case XK_Preferences: mesh_gear(m, K); break;
+        case XK_BackSpace:   mesh_backspace(m, K); break;
     }
 }
 
+/* One contiguous vertex range per layer: caps are the same everywhere, but
+   icons follow each layer's keysyms. keys holds nlayers arrays of n. */
+static void key_geom_build(Key* keys,int n,int nlayers){
+    MeshBuild m={0};
+    mesh_shape_flat(&m);
+    int total=n*nlayers;
+    int* first=realloc(key_geom_first,(total>0?total:1)*sizeof(int));
+    if(first) key_geom_first=first;
+    int* count=realloc(key_geom_count,(total>0?total:1)*sizeof(int));
+    if(count) key_geom_count=count;
+    signed char* st=realloc(key_geom_state,total>0?total:1);
+    if(st) key_geom_state=st;
+    key_geom_n=0; key_geom_layers=0;
+    if(!first||!count||!st) return;
+
+    for(int i=0;i<total;i++){
+        key_geom_first[i]=m.n;
+        mesh_shape_cap(&m,keys[i].x,keys[i].y,keys[i].w,keys[i].h);
+        mesh_rect(&m,keys[i].x,keys[i].y,keys[i].w,keys[i].h,0.3f,0.15f); // halved when pressed
+        mesh_shape_flat(&m);
+        mesh_key_icon(&m,&keys[i]);
+        key_geom_count[i]=m.n-key_geom_first[i];
+        key_geom_state[i]=0;
+    }
+    free(key_geom_col[0]); free(key_geom_col[1]);
+    key_geom_col[0]=m.col[0]; key_geom_col[1]=m.col[1];
+
+    if(!key_pos_vbo){ glGenBuffers(1,&key_pos_vbo); glGenBuffers(1,&key_col_vbo); }
+    glBindBuffer(GL_ARRAY_BUFFER,key_pos_vbo);
+    glBufferData(GL_ARRAY_BUFFER,m.n*KEY_VTX_FLOATS*sizeof(float),m.pos,GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER,key_col_vbo);
+    glBufferData(GL_ARRAY_BUFFER,m.n*sizeof(KeyCol),key_geom_col[0],GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
+    free(m.pos);
+    key_geom_n=n; key_geom_layers=nlayers;
+}
+
+// Mesh record of key i in the active layer
+static int key_geom_rec(int i){
+    return (layer_active<key_geom_layers?layer_active:0)*key_geom_n+i;
+}
+
+static void key_geom_set_pressed(int i,int is_pressed){
+    if(i<0||i>=key_geom_n) return;
+    i=key_geom_rec(i);
+    if(key_geom_state[i]==is_pressed) return;
+    glBindBuffer(GL_ARRAY_BUFFER,key_col_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER,key_geom_first[i]*sizeof(KeyCol),
+                    key_geom_count[i]*sizeof(KeyCol),&key_geom_col[is_pressed][key_geom_first[i]]);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
+    key_geom_state[i]=(signed char)is_pressed;
+}
+
+static void key_geom_bind(int width,int height){
+    const GLsizei stride=KEY_VTX_FLOATS*sizeof(float);
+    glUseProgram(key_prog);
+    glUniform2f(key_uRes,(float)width,(float)height);
+    glBindBuffer(GL_ARRAY_BUFFER,key_pos_vbo);
+    glVertexAttribPointer(key_aPos,2,GL_FLOAT,GL_FALSE,stride,(void*)0);
+    glEnableVertexAttribArray(key_aPos);
+    glVertexAttribPointer(key_aLocal,2,GL_FLOAT,GL_FALSE,stride,(void*)(2*sizeof(float)));
+    glEnableVertexAttribArray(key_aLocal);
+    glVertexAttribPointer(key_aShape,3,GL_FLOAT,GL_FALSE,stride,(void*)(4*sizeof(float)));
+    glEnableVertexAttribArray(key_aShape);
+    glBindBuffer(GL_ARRAY_BUFFER,key_col_vbo);
+    glVertexAttribPointer(key_aCol,4,GL_UNSIGNED_BYTE,GL_TRUE,sizeof(KeyCol),(void*)0);
+    glEnableVertexAttribArray(key_aCol);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
+}
+
+// the rect/text/blit programs use fewer attributes; don't leave ours enabled
+static void key_geom_unbind(void){
+    glDisableVertexAttribArray(key_aLocal);
+    glDisableVertexAttribArray(key_aShape);
+}
+
+/* Is K shown pressed? Caps and layer keys stay down while their mode is active. */
+static int key_is_down(const Key* K,int is_pressed){
+    if (K->keysym == XK_Caps_Lock && caps_down) return 1;
+    if (K->layer && K->layer == layer_active) return 1;
+    return is_pressed?1:0;
+}
+
+/* Draw key faces and icons from the resident buffers, one draw call.
+   pressed==NULL draws every key in its released state. */
+static void draw_keys(int width,int height,Key*keys,int n,const unsigned char* pressed){
+    if(n>key_geom_n) n=key_geom_n;
+    for(int i=0;i<n;i++)
+        key_geom_set_pressed(i,pressed?key_is_down(&keys[i],pressed[i]):0);
+    if(n==0) return;
+    int r0=key_geom_rec(0), r1=key_geom_rec(n-1);
+    key_geom_bind(width,height);
+    draw_arrays(GL_TRIANGLES,key_geom_first[r0],key_geom_first[r1]+key_geom_count[r1]-key_geom_first[r0]);
+    key_geom_unbind();
+}
+
+/* Draw just key i from the resident buffers (pressed-key overlays) */
+static void draw_key(int width,int height,int i,int is_pressed){
+    if(i<0||i>=key_geom_n) return;
+    key_geom_set_pressed(i,is_pressed);
+    int r=key_geom_rec(i);
+    key_geom_bind(width,height);
+    draw_arrays(GL_TRIANGLES,key_geom_first[r],key_geom_count[r]);
+    key_geom_unbind();
+}
+
+/* Queue UTF-8 text from the glyph cache; drawn at the next text_batch_flush */
+static void draw_text_colored(const char* str,float x,float y,float scale,
+                              float r,float g,float b){
+    const float texel=1.0f/GLYPH_PAGE;
+    float xpos=x;
+    for(const char* p=str;*p;){
+        unsigned int cp=utf8_next(&p);
+        if(cp<32) continue;
+        int s=glyph_get(cp);
+        if(s<0) continue;
+        Glyph* gl=&glyphs[s];
+        if(gl->w && gl->h){
+            int c=s%GLYPH_PER_PAGE;
+            float cx=(float)((c%GLYPH_PER_ROW)*GLYPH_CELL+1), cy=(float)((c/GLYPH_PER_ROW)*GLYPH_CELL+1);
+            float x0=xpos+gl->xoff*scale;
+            float y0=y+gl->yoff*scale;
+            float x1=x0+gl->w*scale;
+            float y1=y0+gl->h*scale;
+            text_batch_quad(s/GLYPH_PER_PAGE,x0,y0,x1,y1,
+                            cx*texel,cy*texel,(cx+gl->w)*texel,(cy+gl->h)*texel,
+                            r,g,b);
+        }
+        xpos+=gl->xadvance*scale;
+    }
+}
+
+static void draw_text(const char* str,float x,float y,float scale){
+    draw_text_colored(str,x,y,scale,1.0f,1.0f,1.0f);
+}
+
+static void draw_key_labels(Key* K, int shift_down, int caps_down) {
+    float white[3] = {1.0f,1.0f,1.0f};
+    float grey[3]  = {0.7f,0.7f,0.7f};
+    const char* label = key_str(K->label);
+    const char* shift_label = key_str(K->shift_label);
+
+    // Helper: is this a letter key (exactly one alphabetic character)?
+    bool is_letter = (strlen(label) == 1) && isalpha((unsigned char)label[0]);
+
     // 1) Letters: single centered label, case toggled by caps ^ shift
 
 /*
     if (is_letter) {
         char buf[2] = {0};
-        buf[0] = (caps_down ^ shift_down) ? toupper((unsigned char)K->label[0])
-                                          : tolower((unsigned char)K->label[0]);
+        buf[0] = (caps_down ^ shift_down) ? toupper((unsigned char)label[0])
+                                          : tolower((unsigned char)label[0]);
 
         float scale = fmaxf(0.8f,(K->h*0.5f)/32.0f);
         float tw = text_width(buf, scale);
         float tx = K->x + (K->w - tw)/2.0f;
         float ty = K->y + K->h*0.65f;
-        draw_text_colored(buf, tx, ty, scale, win_w, win_h, white[0], white[1], white[2]);
+        draw_text_colored(buf, tx, ty, scale, white[0], white[1], white[2]);
         return;
     }
 */
@@ -235,22 +1040,22 @@ if (fn_down) {
 if (is_letter) {
     char buf[2] = {0};
     buf[0] = (caps_down ^ shift_down)
-               ? toupper((unsigned char)K->label[0])
-               : tolower((unsigned char)K->label[0]);
+               ? toupper((unsigned char)label[0])
+               : tolower((unsigned char)label[0]);
 
     float scale = fmaxf(0.8f,(K->h*0.5f)/32.0f);
     float tx = K->x + 4.0f;          // left padding
     float ty = K->y + scale * 24.0f; // top padding
-    draw_text_colored(buf, tx, ty, scale, win_w, win_h, 1,1,1);
+    draw_text_colored(buf, tx, ty, scale, 1,1,1);
     return;
 }
 
     // 2) Dual-label keys: show both normal (center) and shift (top-left)
     // Layout JSON already provides shift_label for number/punctuation keys.
-    if (K->shift_label[0] != '\0') {
+    if (shift_label[0] != '\0') {
         // Centered normal label
         float scale_main = fmaxf(0.8f,(K->h*0.5f)/32.0f);
-        float tw_main = text_width(K->label, scale_main);
+        float tw_main = text_width(label, scale_main);
         float tx_main = K->x + (K->w - tw_main)/2.0f;
         float ty_main = K->y + K->h*0.65f;
 
@@ -261,12 +1066,12 @@ if (is_letter) {
 
         if (shift_down) {
             // When Shift is pressed: top-left small becomes white, center becomes grey
-            draw_text_colored(K->label,      tx_main,  ty_main,  scale_main,  win_w, win_h, grey[0],  grey[1],  grey[2]);
-            draw_text_colored(K->shift_label,tx_shift, ty_shift, scale_shift, win_w, win_h, white[0], white[1], white[2]);
+            draw_text_colored(label,      tx_main,  ty_main,  scale_main,  grey[0],  grey[1],  grey[2]);
+            draw_text_colored(shift_label,tx_shift, ty_shift, scale_shift, white[0], white[1], white[2]);
         } else {
             // Default: center is white, top-left small is grey
-            draw_text_colored(K->label,      tx_main,  ty_main,  scale_main,  win_w, win_h, white[0], white[1], white[2]);
-            draw_text_colored(K->shift_label,tx_shift, ty_shift, scale_shift, win_w, win_h, grey[0],  grey[1],  grey[2]);
+            draw_text_colored(label,      tx_main,  ty_main,  scale_main,  white[0], white[1], white[2]);
+            draw_text_colored(shift_label,tx_shift, ty_shift, scale_shift, grey[0],  grey[1],  grey[2]);
         }
         return;
     }
@@ -276,8 +1081,8 @@ if (is_letter) {
     float scale = fmaxf(0.8f,(K->h*0.5f)/32.0f);
     float tx = K->x + 4.0f;                 // padding from left
     float ty = K->y + scale * 24.0f;        // padding from top
-    draw_text_colored(K->label, tx, ty, scale,
-                      win_w, win_h, white[0], white[1], white[2]);
+    draw_text_colored(label, tx, ty, scale,
+                      white[0], white[1], white[2]);
 }
 
 
@@ -286,10 +1091,17 @@ if (is_letter) {
 
 /* Load font atlas */
 
+static bool gl_has_ext(const char* name){
+    const char* exts=(const char*)glGetString(GL_EXTENSIONS);
+    size_t len=strlen(name);
+    for(const char* p=exts; p && (p=strstr(p,name)); p+=len){
+        if((p==exts||p[-1]==' ') && (p[len]==' '||p[len]=='\0')) return true;
+    }
+    return false;
+}
 
 static void init_font(){
-    unsigned char ttf_buffer[1<<20];
-    unsigned char bitmap[512*512];
+    static unsigned char ttf_buffer[1<<20]; // glyphs are rasterised from it on demand
 
     char exe_path[1024];
     ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path)-1);
@@ -305,11 +1117,13 @@ static void init_font(){
     if(!f){ fprintf(stderr,"Font not found at %s\n", font_path); exit(1); }
 
     fread(ttf_buffer,1,1<<20,f); fclose(f);
-    stbtt_BakeFontBitmap(ttf_buffer,0,28.0,bitmap,512,512,32,96,cdata);
-    glGenTextures(1,&fontTex);
-    glBindTexture(GL_TEXTURE_2D,fontTex);
-    glTexImage2D(GL_TEXTURE_2D,0,GL_ALPHA,512,512,0,GL_ALPHA,GL_UNSIGNED_BYTE,bitmap);
-    glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+    if(!stbtt_InitFont(&font_info,ttf_buffer,stbtt_GetFontOffsetForIndex(ttf_buffer,0))){
+        fprintf(stderr,"Can't parse font %s\n", font_path); exit(1);
+    }
+    font_scale=stbtt_ScaleForPixelHeight(&font_info,FONT_PX);
+
+    for(int b=0;b<GLYPH_BUCKETS;b++) glyph_bucket[b]=-1;
+    for(unsigned int cp=32;cp<127;cp++) glyph_get(cp); // ASCII is always needed
 }
 
 
@@ -327,59 +1141,275 @@ static void init_font(){
     glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
 }
 */
-/* Utility for ms timestamp */
-static long now_ms(){struct timespec ts;clock_gettime(CLOCK_MONOTONIC,&ts);return ts.tv_sec*1000+ts.tv_nsec/1000000;}
 
 /* Layout loader */
 typedef struct { float start,end; } Span;
 
 typedef struct {
-    char label[64];
-    char action[32];
+    uint32_t label, action; // string pool offsets
 } MenuEntry;
 
-MenuEntry pref_menu[16];
+MenuEntry* pref_menu = NULL;
 int pref_menu_count = 0;
 
-void load_menu_json(cJSON* root) {
+/* Layout store: one arena per layout, sized from the JSON, holding the key
+   records of every layer (base first, then one full copy per named layer
+   with its overrides applied), one byte of pressed state per key, the
+   layer names, the menu and a pool of interned strings. Strings are referenced by offset and the section
+   pointers are derived from base + offsets, so the arena itself holds no
+   pointers. */
+#define LAYOUT_ALIGN(n) (((n)+15)&~(size_t)15)
+typedef struct {
+    int nkeys, nlayers, nmenu, key_cap, menu_cap; // nkeys per layer
+    uint32_t strings_len;  // pool bytes in use ("" at offset 0)
+    size_t size, off_pressed, off_layers, off_menu, off_strings; // keys at offset 0
+    void* base;
+    size_t map_len; // nonzero: base is a mapping of the layout cache
+    Key* keys; unsigned char* pressed; uint32_t* layers; MenuEntry* menu; char* strings;
+} Layout;
+
+// Key records of one layer; switching layers is just picking this pointer
+static Key* layer_keys(const Layout* L,int layer){ return L->keys+(size_t)layer*L->nkeys; }
+
+/* Compiled layout cache: a header followed by the arena, byte for byte.
+   One file per layout path and window size, overwritten when the JSON
+   changes; the header carries the content hash it was built from. A hit
+   is one mmap with no parsing; MAP_PRIVATE keeps pressed-state writes local. */
+#define LAYOUT_CACHE_MAGIC   0x4342424bu // "KBBC"
+#define LAYOUT_CACHE_VERSION 2
+typedef struct {
+    uint32_t magic, version, key_size, menu_size;
+    uint64_t json_hash;
+    int32_t win_w, win_h, nkeys, nlayers, nmenu, key_cap, menu_cap;
+    uint32_t strings_len;
+    uint64_t size, off_pressed, off_layers, off_menu, off_strings;
+} LayoutCacheHdr;
+
+static void layout_bind(Layout* L){
+    char* b=L->base;
+    L->keys=(Key*)b;
+    L->pressed=(unsigned char*)(b+L->off_pressed);
+    L->layers=(uint32_t*)(b+L->off_layers);
+    L->menu=(MenuEntry*)(b+L->off_menu);
+    L->strings=b+L->off_strings;
+}
+
+static bool layout_alloc(Layout* L,int nkeys,int nlayers,int nmenu,size_t string_bytes){
+    memset(L,0,sizeof(*L));
+    L->off_pressed=LAYOUT_ALIGN((size_t)nkeys*nlayers*sizeof(Key));
+    L->off_layers=LAYOUT_ALIGN(L->off_pressed+nkeys);
+    L->off_menu=LAYOUT_ALIGN(L->off_layers+(size_t)nlayers*sizeof(uint32_t));
+    L->off_strings=LAYOUT_ALIGN(L->off_menu+(size_t)nmenu*sizeof(MenuEntry));
+    L->size=L->off_strings+string_bytes;
+    L->base=calloc(1,L->size);
+    if(!L->base) return false;
+    L->key_cap=nkeys; L->menu_cap=nmenu; L->nlayers=nlayers;
+    L->strings_len=1;
+    layout_bind(L);
+    return true;
+}
+
+static void layout_free(Layout* L){
+    if(L->map_len) munmap((char*)L->base-LAYOUT_ALIGN(sizeof(LayoutCacheHdr)),L->map_len);
+    else free(L->base);
+    memset(L,0,sizeof(*L));
+}
+
+static void layout_activate(const Layout* L){
+    layout_strings=L->strings?L->strings:"";
+    pref_menu=L->menu;
+    pref_menu_count=L->nmenu;
+}
+
+static uint32_t str_hash(const char* s){ // FNV-1a
+    uint32_t h=2166136261u;
+    while(*s){ h^=(unsigned char)*s++; h*=16777619u; }
+    return h;
+}
+
+// Open-addressing set of pool offsets (+1), used only while loading
+typedef struct { uint32_t* slot; uint32_t mask; } StrIntern;
+
+static uint32_t layout_intern(Layout* L,StrIntern* I,const char* s){
+    if(!s||!*s) return 0;
+    uint32_t h=str_hash(s)&I->mask;
+    for(;I->slot[h];h=(h+1)&I->mask)
+        if(strcmp(L->strings+I->slot[h]-1,s)==0) return I->slot[h]-1;
+    size_t n=strlen(s)+1;
+    uint32_t off=L->strings_len;
+    memcpy(L->strings+off,s,n);
+    L->strings_len+=(uint32_t)n;
+    I->slot[h]=off+1;
+    return off;
+}
+
+static cJSON* menu_prefs_json(cJSON* root){
     cJSON* menu = cJSON_GetObjectItem(root, "menu");
-    if (!menu) return;
-    cJSON* prefs = cJSON_GetObjectItem(menu, "preferences");
-    if (!cJSON_IsArray(prefs)) return;
+    cJSON* prefs = menu ? cJSON_GetObjectItem(menu, "preferences") : NULL;
+    return cJSON_IsArray(prefs) ? prefs : NULL;
+}
+
+static bool menu_entry_json(cJSON* item, cJSON** lab, cJSON** act){
+    *lab = cJSON_GetObjectItem(item, "label");
+    *act = cJSON_GetObjectItem(item, "action");
+    return cJSON_IsString(*lab) && cJSON_IsString(*act);
+}
+
+void load_menu_json(cJSON* root, Layout* L, StrIntern* I) {
+    cJSON* prefs = menu_prefs_json(root);
+    if (!prefs) return;
 
     int n = cJSON_GetArraySize(prefs);
-    for (int i=0; i<n && i<16; i++) {
-        cJSON* item = cJSON_GetArrayItem(prefs, i);
-        cJSON* lab = cJSON_GetObjectItem(item, "label");
-        cJSON* act = cJSON_GetObjectItem(item, "action");
-        if (cJSON_IsString(lab) && cJSON_IsString(act)) {
-            strncpy(pref_menu[pref_menu_count].label, lab->valuestring, 63);
-            strncpy(pref_menu[pref_menu_count].action, act->valuestring, 31);
-            pref_menu_count++;
+    for (int i=0; i<n && L->nmenu<L->menu_cap; i++) {
+        cJSON *lab, *act;
+        if (menu_entry_json(cJSON_GetArrayItem(prefs, i), &lab, &act)) {
+            L->menu[L->nmenu].label = layout_intern(L, I, lab->valuestring);
+            L->menu[L->nmenu].action = layout_intern(L, I, act->valuestring);
+            L->nmenu++;
         }
     }
 }
 
+// A layout entry is used if it has a label and either a keysym or a text
+static bool key_entry_json(cJSON* obj, cJSON** lab, cJSON** shlab, cJSON** ks, cJSON** txt){
+    if(!cJSON_IsObject(obj)) return false;
+    *lab=cJSON_GetObjectItem(obj,"label");
+    *shlab=cJSON_GetObjectItem(obj,"shift_label");
+    *ks=cJSON_GetObjectItem(obj,"keysym");
+    *txt=cJSON_GetObjectItem(obj,"text");
+    if(!*txt) *txt=cJSON_GetObjectItem(obj,"macro");
+    if(!cJSON_IsString(*shlab)) *shlab=NULL;
+    if(!cJSON_IsString(*ks)) *ks=NULL;
+    if(!cJSON_IsString(*txt)) *txt=NULL;
+    return cJSON_IsString(*lab) && (*ks||*txt);
+}
 
-int load_layout_json(const char* path, Key* keys, int maxkeys, int win_w, int win_h){
-    FILE* f=fopen(path,"rb"); if(!f){ perror("open"); return 0; }
-    fseek(f,0,SEEK_END); long len=ftell(f); rewind(f);
-    char* data=malloc(len+1); fread(data,1,len,f); data[len]='\0'; fclose(f);
+// Layer override: any of label/shift_label/keysym/text, all optional
+static void key_override_json(cJSON* obj, cJSON** lab, cJSON** shlab, cJSON** ks, cJSON** txt){
+    key_entry_json(obj,lab,shlab,ks,txt);
+    if(!cJSON_IsString(*lab)) *lab=NULL;
+}
 
-    cJSON* root=cJSON_Parse(data);
-    if(!root){ fprintf(stderr,"JSON parse error\n"); free(data); return 0; }
+// Keysym from a layout name, with or without the XK_ prefix
+static KeySym layout_keysym(const char* name){
+    if(strcmp(name,"XK_Preferences")==0) return XK_Preferences; // custom constant defined at top of file
+    const char* lookup=name;
+    if(strncmp(lookup,"XK_",3)==0) lookup+=3;
+    KeySym ks=XStringToKeysym(lookup);
+    if(ks==NoSymbol) ks=XStringToKeysym(name);
+    return ks;
+}
 
-    load_menu_json(root);
+/* "layers": { "fn": { "XK_1": {"label":"F1","keysym":"XK_F1"}, ... }, ... }
+   Each named layer overrides keys by their base keysym. */
+static cJSON* layers_json(cJSON* root){
+    cJSON* layers=cJSON_GetObjectItem(root,"layers");
+    return cJSON_IsObject(layers)?layers:NULL;
+}
+
+// 1-based index of a named layer, 0 if the layout has none by that name
+static int layer_index_json(cJSON* root, const char* name){
+    cJSON* layers=layers_json(root);
+    cJSON* lay; int l=0;
+    if(layers) cJSON_ArrayForEach(lay,layers){
+        if(!cJSON_IsObject(lay)) continue;
+        l++;
+        if(strcmp(lay->string,name)==0) return l;
+    }
+    return 0;
+}
+
+static size_t str_bytes(cJSON* s){ return s ? strlen(s->valuestring)+1 : 0; }
+
+// Sizing pass: count keys, layers, menu entries, strings and worst-case pool bytes
+static void layout_measure(cJSON* root, cJSON* rows, int* nkeys, int* nlayers, int* nmenu,
+                           int* nstrs, size_t* nstr){
+    *nkeys=0; *nlayers=1; *nmenu=0; *nstrs=0; *nstr=1;
+    cJSON* prefs=menu_prefs_json(root);
+    cJSON *it, *lab, *act, *shlab, *ks, *txt;
+    if(prefs) cJSON_ArrayForEach(it,prefs)
+        if(menu_entry_json(it,&lab,&act)){ (*nmenu)++; *nstrs+=2; *nstr+=str_bytes(lab)+str_bytes(act); }
+    cJSON* row;
+    cJSON_ArrayForEach(row,rows){
+        if(!cJSON_IsArray(row)) continue;
+        cJSON_ArrayForEach(it,row)
+            if(key_entry_json(it,&lab,&shlab,&ks,&txt)){
+                (*nkeys)++; *nstrs+=3;
+                *nstr+=str_bytes(lab)+str_bytes(shlab)+str_bytes(txt);
+            }
+    }
+    cJSON* layers=layers_json(root);
+    cJSON* lay;
+    if(layers) cJSON_ArrayForEach(lay,layers){
+        if(!cJSON_IsObject(lay)) continue;
+        (*nlayers)++; (*nstrs)++;
+        *nstr+=strlen(lay->string)+1;
+        cJSON_ArrayForEach(it,lay){
+            if(!cJSON_IsObject(it)) continue;
+            key_override_json(it,&lab,&shlab,&ks,&txt);
+            *nstrs+=3;
+            *nstr+=str_bytes(lab)+str_bytes(shlab)+str_bytes(txt);
+        }
+    }
+}
+
+/* Fill layers 1.. as copies of the base keys with their overrides applied.
+   Positions are shared, so one hit index serves every layer; the key mesh
+   keeps a range per layer because icons follow the layer's keysyms. */
+static void layout_build_layers(cJSON* root, Layout* L, StrIntern* I){
+    cJSON* layers=layers_json(root);
+    cJSON *lay, *ov, *lab, *shlab, *ks, *txt;
+    int l=0;
+    L->layers[0]=0;
+    if(layers) cJSON_ArrayForEach(lay,layers){
+        if(!cJSON_IsObject(lay)) continue;
+        Key* dst=layer_keys(L,++l);
+        L->layers[l]=layout_intern(L,I,lay->string);
+        memcpy(dst,L->keys,(size_t)L->nkeys*sizeof(Key));
+        cJSON_ArrayForEach(ov,lay){
+            if(!cJSON_IsObject(ov)) continue;
+            KeySym from=layout_keysym(ov->string);
+            if(from==NoSymbol){ fprintf(stderr,"layer %s: unknown keysym %s\n",lay->string,ov->string); continue; }
+            key_override_json(ov,&lab,&shlab,&ks,&txt);
+            for(int i=0;i<L->nkeys;i++){
+                if(L->keys[i].keysym!=from) continue;
+                Key* K=&dst[i];
+                if(lab){ K->label=layout_intern(L,I,lab->valuestring); K->shift_label=0; }
+                if(shlab) K->shift_label=layout_intern(L,I,shlab->valuestring);
+                if(ks) K->keysym=layout_keysym(ks->valuestring);
+                if(txt) K->text=layout_intern(L,I,txt->valuestring);
+            }
+        }
+    }
+}
+
+// Parse layout JSON into a fresh arena in *L; returns the key count (0 on error)
+static int layout_parse_json(const char* data, Layout* L, int win_w, int win_h){
+    memset(L,0,sizeof(*L));
+    cJSON* root=cJSON_Parse(data);
+    if(!root){ fprintf(stderr,"JSON parse error\n"); return 0; }
 
     cJSON* rows=cJSON_GetObjectItem(root,"rows");
-    if(!cJSON_IsArray(rows)){ fprintf(stderr,"no rows array\n"); cJSON_Delete(root); free(data); return 0; }
+    if(!cJSON_IsArray(rows)){ fprintf(stderr,"no rows array\n"); cJSON_Delete(root); return 0; }
+
+    int maxkeys, nlayers, maxmenu, nstrs; size_t nstr;
+    layout_measure(root,rows,&maxkeys,&nlayers,&maxmenu,&nstrs,&nstr);
+    uint32_t icap=16; while(icap<2u*(uint32_t)nstrs) icap<<=1;
+    StrIntern intern={calloc(icap,sizeof(uint32_t)),icap-1};
+    if(!intern.slot||!layout_alloc(L,maxkeys,nlayers,maxmenu,nstr)){
+        fprintf(stderr,"layout: out of memory\n");
+        free(intern.slot); cJSON_Delete(root); return 0;
+    }
+    Key* keys=L->keys;
+
+    load_menu_json(root,L,&intern);
 
     int nrows=cJSON_GetArraySize(rows);
     float row_h=(float)win_h/nrows;
 
     int nkeys=0;
-    Span* reserved[128]={0};
-    int reserved_count[128]={0};
+    Span** reserved=calloc(nrows,sizeof(Span*));
+    int* reserved_count=calloc(nrows,sizeof(int));
 
     const float GAP_PX    = 2.0f; // horizontal gap
     const float ROW_GAP_PX= 2.0f; // vertical gap between rows
@@ -416,11 +1446,8 @@ int load_layout_json(const char* path, Key* keys, int maxkeys, int win_w, int wi
 
         for(int c=0;c<ncols;c++){
             cJSON* obj=cJSON_GetArrayItem(row,c);
-            if(!cJSON_IsObject(obj)) continue;
-            cJSON* lab=cJSON_GetObjectItem(obj,"label");
-            cJSON* shlab=cJSON_GetObjectItem(obj,"shift_label");
-            cJSON* ks=cJSON_GetObjectItem(obj,"keysym");
-            if(!lab||!ks||!cJSON_IsString(lab)||!cJSON_IsString(ks)) continue;
+            cJSON *lab, *shlab, *ks, *txt;
+            if(!key_entry_json(obj,&lab,&shlab,&ks,&txt)) continue;
 
             cJSON* wobj=cJSON_GetObjectItem(obj,"width");
             cJSON* hobj=cJSON_GetObjectItem(obj,"height");
@@ -438,10 +1465,8 @@ int load_layout_json(const char* path, Key* keys, int maxkeys, int win_w, int wi
 
             if(nkeys<maxkeys){
                 Key* K=&keys[nkeys++];
-                K->label[0]='\0'; K->shift_label[0]='\0';
-                strncpy(K->label,lab->valuestring,sizeof(K->label)-1);
-                if(shlab&&cJSON_IsString(shlab))
-                    strncpy(K->shift_label,shlab->valuestring,sizeof(K->shift_label)-1);
+                K->label=layout_intern(L,&intern,lab->valuestring);
+                K->shift_label=shlab?layout_intern(L,&intern,shlab->valuestring):0;
 
                 // Vertical spacing applied here
                 K->x=xcursor;
@@ -465,16 +1490,26 @@ int load_layout_json(const char* path, Key* keys, int maxkeys, int win_w, int wi
                 xcursor=K->x+K->w;
                 if(c<ncols-1) xcursor+=GAP_PX;
 
-// Resolve keysym, with special case for Preferences
-if (strcmp(ks->valuestring,"XK_Preferences")==0) {
-    K->keysym = XK_Preferences;   // custom constant you defined at top of file
-} else {
-    const char* ks_lookup=ks->valuestring;
-    if(strncmp(ks_lookup,"XK_",3)==0) ks_lookup+=3;
-    K->keysym=XStringToKeysym(ks_lookup);
-    if(K->keysym==NoSymbol) K->keysym=XStringToKeysym(ks->valuestring);
+K->text = txt ? layout_intern(L, &intern, txt->valuestring) : 0;
+cJSON* rd = cJSON_GetObjectItem(obj, "repeat_delay");
+cJSON* ri = cJSON_GetObjectItem(obj, "repeat_interval");
+K->repeat_delay = cJSON_IsNumber(rd) ? rd->valueint : 0;
+K->repeat_interval = cJSON_IsNumber(ri) ? ri->valueint : 0;
+if (K->repeat_interval < 0) { // disabling repeat is repeat_delay's job
+    fprintf(stderr, "layout: %s: repeat_interval %d < 0, using the system rate "
+            "(set repeat_delay < 0 to disable repeat)\n", lab->valuestring, K->repeat_interval);
+    K->repeat_interval = 0;
 }
 
+// Resolve keysym (text-only keys have none)
+K->keysym = ks ? layout_keysym(ks->valuestring) : NoSymbol;
+
+// Layer toggle: "layer":"<name>"; an Fn (Mode_switch) key defaults to "fn"
+cJSON* ly = cJSON_GetObjectItem(obj, "layer");
+K->layer = cJSON_IsString(ly) ? (short)layer_index_json(root, ly->valuestring) :
+           K->keysym == XK_Mode_switch ? (short)layer_index_json(root, "fn") : 0;
+K->layer_lock = cJSON_IsTrue(cJSON_GetObjectItem(obj, "layer_lock"));
+
 
                 int spans_down=(int)floorf(hmult)-1;
                 for(int dr=1;dr<=spans_down;dr++){
@@ -494,10 +1529,139 @@ if (strcmp(ks->valuestring,"XK_Preferences")==0) {
     }
 
     for(int r=0;r<nrows;r++) free(reserved[r]);
-    cJSON_Delete(root); free(data);
+    L->nkeys=nkeys; // == key_cap: the sizing pass counts the same entries
+    layout_build_layers(root,L,&intern);
+    free(reserved); free(reserved_count); free(intern.slot);
+    cJSON_Delete(root);
     return nkeys;
 }
 
+static uint64_t bytes_hash64(const unsigned char* p,size_t n){ // FNV-1a
+    uint64_t h=14695981039346656037ull;
+    for(size_t i=0;i<n;i++){ h^=p[i]; h*=1099511628211ull; }
+    return h;
+}
+
+static bool layout_cache_path(char* out,size_t cap,const char* path,int win_w,int win_h){
+    const char* xdg=getenv("XDG_CACHE_HOME");
+    const char* home=getenv("HOME");
+    char dir[512];
+    if(xdg&&*xdg) snprintf(dir,sizeof(dir),"%s",xdg);
+    else if(home&&*home) snprintf(dir,sizeof(dir),"%s/.cache",home);
+    else return false;
+    mkdir(dir,0755);
+    char* abs=realpath(path,NULL);
+    const char* key=abs?abs:path;
+    uint64_t h=bytes_hash64((const unsigned char*)key,strlen(key));
+    free(abs);
+    return snprintf(out,cap,"%s/keyboard-layout-%016llx-%dx%d.bin",dir,
+                    (unsigned long long)h,win_w,win_h)<(int)cap;
+}
+
+// Section layout of a cache header must match what layout_alloc produces,
+// so a truncated or foreign file can't point outside the mapping
+static bool layout_cache_sections_ok(const LayoutCacheHdr* H){
+    if(H->nkeys<0||H->nlayers<1||H->nmenu<0||H->nkeys>H->key_cap||H->nmenu>H->menu_cap) return false;
+    uint64_t keys_end=(uint64_t)H->key_cap*H->nlayers*sizeof(Key);
+    return H->off_pressed%16==0 && H->off_layers%16==0 && H->off_menu%16==0 && H->off_strings%16==0 &&
+           keys_end<=H->off_pressed &&
+           H->off_pressed+H->key_cap<=H->off_layers &&
+           H->off_layers+(uint64_t)H->nlayers*sizeof(uint32_t)<=H->off_menu &&
+           H->off_menu+(uint64_t)H->menu_cap*sizeof(MenuEntry)<=H->off_strings &&
+           H->strings_len>=1 && H->off_strings+H->strings_len<=H->size;
+}
+
+// Every string offset must land inside the pool, which must end in a NUL
+static bool layout_strings_ok(const Layout* L){
+    const uint32_t n=L->strings_len;
+    if(L->strings[0]!='\0'||L->strings[n-1]!='\0') return false;
+    for(int i=0;i<L->nkeys*L->nlayers;i++){
+        const Key* K=&L->keys[i];
+        if(K->label>=n||K->shift_label>=n||K->text>=n||K->layer<0||K->layer>=L->nlayers) return false;
+    }
+    for(int i=0;i<L->nlayers;i++) if(L->layers[i]>=n) return false;
+    for(int i=0;i<L->nmenu;i++) if(L->menu[i].label>=n||L->menu[i].action>=n) return false;
+    return true;
+}
+
+static bool layout_cache_load(const char* cpath,uint64_t hash,int win_w,int win_h,Layout* L){
+    int fd=open(cpath,O_RDONLY|O_CLOEXEC);
+    if(fd<0) return false;
+    struct stat st;
+    size_t hdr=LAYOUT_ALIGN(sizeof(LayoutCacheHdr));
+    if(fstat(fd,&st)!=0||(size_t)st.st_size<hdr){ close(fd); return false; }
+    char* m=mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(m==MAP_FAILED) return false;
+    const LayoutCacheHdr* H=(const LayoutCacheHdr*)m;
+    if(H->magic!=LAYOUT_CACHE_MAGIC||H->version!=LAYOUT_CACHE_VERSION||
+       H->key_size!=sizeof(Key)||H->menu_size!=sizeof(MenuEntry)||
+       H->json_hash!=hash||H->win_w!=win_w||H->win_h!=win_h||
+       hdr+H->size!=(uint64_t)st.st_size||!layout_cache_sections_ok(H)){
+        munmap(m,st.st_size); return false;
+    }
+    memset(L,0,sizeof(*L));
+    L->nkeys=H->nkeys; L->nlayers=H->nlayers; L->nmenu=H->nmenu; L->key_cap=H->key_cap; L->menu_cap=H->menu_cap;
+    L->strings_len=H->strings_len; L->size=H->size;
+    L->off_pressed=H->off_pressed; L->off_layers=H->off_layers;
+    L->off_menu=H->off_menu; L->off_strings=H->off_strings;
+    L->base=m+hdr; L->map_len=st.st_size;
+    layout_bind(L);
+    if(!layout_strings_ok(L)){ munmap(m,st.st_size); memset(L,0,sizeof(*L)); return false; }
+    return true;
+}
+
+// Written to a temp file and renamed so a concurrent start never maps half a file
+static void layout_cache_store(const char* cpath,uint64_t hash,int win_w,int win_h,const Layout* L){
+    LayoutCacheHdr H={LAYOUT_CACHE_MAGIC,LAYOUT_CACHE_VERSION,sizeof(Key),sizeof(MenuEntry),hash,
+                      win_w,win_h,L->nkeys,L->nlayers,L->nmenu,L->key_cap,L->menu_cap,L->strings_len,
+                      L->size,L->off_pressed,L->off_layers,L->off_menu,L->off_strings};
+    char tmp[600];
+    snprintf(tmp,sizeof(tmp),"%s.%d",cpath,(int)getpid());
+    FILE* f=fopen(tmp,"wb");
+    if(!f) return;
+    static const char pad[16];
+    size_t hdr=LAYOUT_ALIGN(sizeof(H));
+    bool ok=fwrite(&H,sizeof(H),1,f)==1 && fwrite(pad,1,hdr-sizeof(H),f)==hdr-sizeof(H) &&
+            fwrite(L->base,1,L->size,f)==L->size;
+    if(fclose(f)!=0) ok=false;
+    if(!ok||rename(tmp,cpath)!=0) unlink(tmp);
+}
+
+/* Load a layout: the compiled cache when it matches the JSON and window
+   size, otherwise parse the JSON and refresh the cache. */
+int load_layout_json(const char* path, Layout* L, int win_w, int win_h){
+    memset(L,0,sizeof(*L));
+    int fd=open(path,O_RDONLY|O_CLOEXEC);
+    if(fd<0){ perror("open"); return 0; }
+    struct stat st;
+    if(fstat(fd,&st)!=0){ perror("stat"); close(fd); return 0; }
+    size_t len=st.st_size;
+    void* json=len?mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0):NULL;
+    close(fd);
+    if(json==MAP_FAILED){ perror("mmap"); return 0; }
+    uint64_t hash=bytes_hash64(json,len);
+    char cpath[512];
+    bool cache=layout_cache_path(cpath,sizeof(cpath),path,win_w,win_h);
+    if(cache&&layout_cache_load(cpath,hash,win_w,win_h,L)){
+        if(json) munmap(json,len);
+        return L->nkeys;
+    }
+    char* data=malloc(len+1);
+    if(!data){
+        fprintf(stderr,"layout: out of memory\n");
+        if(json) munmap(json,len);
+        return 0;
+    }
+    if(json) memcpy(data,json,len);
+    data[len]='\0';
+    if(json) munmap(json,len);
+    int n=layout_parse_json(data,L,win_w,win_h);
+    free(data);
+    if(n>0&&cache) layout_cache_store(cpath,hash,win_w,win_h,L);
+    return n;
+}
+
 
 void draw_backspace_icon(float x, float y, float w, float h, int win_w, int win_h) {
     // Background rectangle
@@ -508,7 +1672,7 @@ void draw_backspace_icon(float x, float y, float w, float h, int win_w, int win_
     glEnableVertexAttribArray(rect_aPos);
     glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&quad[0].r);
     glEnableVertexAttribArray(rect_aCol);
-    glDrawArrays(GL_TRIANGLES,0,6);
+    draw_arrays(GL_TRIANGLES,0,6);
 
     // Chevron: triangle pointing left
     RectVtx chevron[3]={{x+4,y+h/2,r*0.8f,g*0.8f,b*0.8f},
@@ -518,14 +1682,15 @@ void draw_backspace_icon(float x, float y, float w, float h, int win_w, int win_
     glEnableVertexAttribArray(rect_aPos);
     glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&chevron[0].r);
     glEnableVertexAttribArray(rect_aCol);
-    glDrawArrays(GL_TRIANGLES,0,3);
+    draw_arrays(GL_TRIANGLES,0,3);
 
     // Draw “×” centered inside
     float scale = fmaxf(0.6f,(h*0.6f)/32.0f);
     float tw = text_width("×", scale);
     float tx = x + (w - tw)/2.0f;
     float ty = y + h*0.6f;
-    draw_text("×", tx, ty, scale, win_w, win_h);
+    draw_text("×", tx, ty, scale);
+    text_batch_flush(win_w, win_h);
 }
 
 void draw_menu_above_key(Key prefKey, int win_w, int win_h) {
@@ -546,45 +1711,26 @@ void draw_menu_above_key(Key prefKey, int win_w, int win_h) {
     float ph = menu_h + 2*pad;
     float pr=0.15f, pg=0.15f, pb=0.18f; // darker gray panel
 
-    RectVtx pquad[6] = {
-        {px, py, pr, pg, pb},
-        {px+pw, py, pr, pg, pb},
-        {px+pw, py+ph, pr, pg, pb},
-        {px, py, pr, pg, pb},
-        {px+pw, py+ph, pr, pg, pb},
-        {px, py+ph, pr, pg, pb}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&pquad[0].x);
-    glEnableVertexAttribArray(rect_aPos);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&pquad[0].r);
-    glEnableVertexAttribArray(rect_aCol);
-    glDrawArrays(GL_TRIANGLES,0,6);
+    rect_batch_quad(px, py, pw, ph, pr, pg, pb);
 
     // --- Draw each menu entry as a key ---
     for (int m=0; m<pref_menu_count; m++) {
         float ey = y + m*prefKey.h;
         float r=0.6f,g=0.6f,b=0.6f;
         if (menu_pressed == m) { r*=0.5f; g*=0.5f; b*=0.5f; } // darken if pressed
-
-        RectVtx quad[6] = {
-            {x,ey,r,g,b},{x+menu_w,ey,r,g,b},{x+menu_w,ey+prefKey.h,r,g,b},
-            {x,ey,r,g,b},{x+menu_w,ey+prefKey.h,r,g,b},{x,ey+prefKey.h,r,g,b}
-        };
-        glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&quad[0].x);
-        glEnableVertexAttribArray(rect_aPos);
-        glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&quad[0].r);
-        glEnableVertexAttribArray(rect_aCol);
-        glDrawArrays(GL_TRIANGLES,0,6);
+        rect_batch_quad(x, ey, menu_w, prefKey.h, r, g, b);
 
         // Center text inside each entry
         float scale=fmaxf(0.6f,(prefKey.h*0.6f)/32.0f);
-        float tw=text_width(pref_menu[m].label,scale);
+        float tw=text_width(key_str(pref_menu[m].label),scale);
         float tx=x+(menu_w-tw)/2.0f;
         float ty=ey+prefKey.h*0.6f;
-        draw_text(pref_menu[m].label, tx, ty, scale, win_w, win_h);
-
-
+        draw_text(key_str(pref_menu[m].label), tx, ty, scale);
     }
+
+    // Entries don't overlap, so all panels first, then all labels
+    rect_batch_flush(win_w, win_h);
+    text_batch_flush(win_w, win_h);
 }
 
 
@@ -604,13 +1750,14 @@ void draw_menu(int win_w, int win_h) {
     glEnableVertexAttribArray(rect_aPos);
     glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&quad[0].r);
     glEnableVertexAttribArray(rect_aCol);
-    glDrawArrays(GL_TRIANGLES,0,6);
+    draw_arrays(GL_TRIANGLES,0,6);
 
     // Entries
     for (int i=0; i<pref_menu_count; i++) {
         float ty = y + 30 + i*40;
-        draw_text(pref_menu[i].label, x+20, ty, 1.0f, win_w, win_h);
+        draw_text(key_str(pref_menu[i].label), x+20, ty, 1.0f);
     }
+    text_batch_flush(win_w, win_h);
 }
 
 
@@ -650,35 +1797,69 @@ static void debug_window(Display *dpy, Window w) {
 
 
 /* Deepest child under pointer (to lock onto the real input window) */
-static Window deepest_under_pointer(Display *dpy, Window start) {
+/* Window-tree walks go through XCB on the Xlib connection, so requests
+   that don't depend on each other are sent as one batch and their replies
+   collected afterwards: one round-trip per tree level, not per window. */
+
+// Follow the first InputOutput child down from w; tree is w's
+// QueryTree reply (may be NULL) and is freed here.
+static Window input_child_walk(xcb_connection_t* c, Window w, xcb_query_tree_reply_t* tree) {
+    while (tree) {
+        int n = xcb_query_tree_children_length(tree);
+        xcb_window_t* kids = xcb_query_tree_children(tree);
+        xcb_get_window_attributes_cookie_t* ac = malloc(n*sizeof(*ac));
+        xcb_query_tree_cookie_t* tc = malloc(n*sizeof(*tc));
+        if (n == 0 || !ac || !tc) { free(ac); free(tc); free(tree); break; }
+        // every child's class and subtree at once; only one subtree is used
+        for (int i=0; i<n; i++) {
+            ac[i] = xcb_get_window_attributes(c, kids[i]);
+            tc[i] = xcb_query_tree(c, kids[i]);
+        }
+        int pick = -1;
+        for (int i=0; i<n; i++) {
+            xcb_get_window_attributes_reply_t* r = xcb_get_window_attributes_reply(c, ac[i], NULL);
+            if (pick < 0 && r && r->_class == XCB_WINDOW_CLASS_INPUT_OUTPUT) pick = i;
+            free(r);
+        }
+        xcb_query_tree_reply_t* next = NULL;
+        for (int i=0; i<n; i++) {
+            if (i == pick) next = xcb_query_tree_reply(c, tc[i], NULL);
+            else xcb_discard_reply(c, tc[i].sequence);
+        }
+        if (pick >= 0) w = kids[pick];
+        free(ac); free(tc); free(tree);
+        tree = next;
+    }
+    return w;
+}
+
+/* Deepest window under the pointer from start, then its input child.
+   The pointer chain is inherently one query per level (the next window
+   comes from the reply); each level's QueryTree rides along so the input
+   child walk starts without another round-trip. */
+static Window input_target_under_pointer(Display *dpy, Window start) {
+    xcb_connection_t* c = XGetXCBConnection(dpy);
     Window w = start;
     for (;;) {
-        Window root_ret, child;
-        int rx, ry, wx, wy; unsigned int mask;
-        if (!XQueryPointer(dpy, w, &root_ret, &child, &rx, &ry, &wx, &wy, &mask))
-            break;
-        if (child == None) break;
+        xcb_query_pointer_cookie_t pc = xcb_query_pointer(c, w);
+        xcb_query_tree_cookie_t tc = xcb_query_tree(c, w);
+        xcb_query_pointer_reply_t* p = xcb_query_pointer_reply(c, pc, NULL);
+        xcb_window_t child = p ? p->child : XCB_NONE;
+        free(p);
+        if (child == XCB_NONE)
+            return input_child_walk(c, w, xcb_query_tree_reply(c, tc, NULL));
+        xcb_discard_reply(c, tc.sequence);
         w = child;
     }
-    return w;
 }
 
-static Window find_input_child(Display *dpy, Window w) {
-    Window root, parent, *children;
-    unsigned int nchildren;
-    if (XQueryTree(dpy, w, &root, &parent, &children, &nchildren)) {
-        for (unsigned int i=0; i<nchildren; i++) {
-            XWindowAttributes attr;
-            if (XGetWindowAttributes(dpy, children[i], &attr) && attr.class == InputOutput) {
-                // descend further if needed
-                Window deeper = find_input_child(dpy, children[i]);
-                if (deeper != None) { XFree(children); return deeper; }
-                return children[i];
-            }
-        }
-        if (children) XFree(children);
-    }
-    return w; // fallback
+static bool window_alive(Display *dpy, Window w) {
+    xcb_connection_t* c = XGetXCBConnection(dpy);
+    xcb_get_window_attributes_reply_t* r =
+        xcb_get_window_attributes_reply(c, xcb_get_window_attributes(c, w), NULL);
+    bool ok = r != NULL;
+    free(r);
+    return ok;
 }
 
 
@@ -696,7 +1877,728 @@ static int my_xerror_handler(Display *dpy, XErrorEvent *err) {
         // reset your cached focus window
         // e.g. last_focus = None;
     }
-    return 0;
+    return 0;
+}
+
+/* Focus tracking without polling: _NET_ACTIVE_WINDOW and focus changes on
+   the root trigger a single XGetInputFocus, and crossing events on a
+   cached toplevel focus the input child under the pointer, resolved afresh
+   each time so moving between widgets of one toplevel follows along. */
+typedef struct { Window w; } TopLevel;
+static TopLevel* toplevels=NULL;
+static int ntoplevels=0, toplevels_cap=0;
+static Window focus_own[3]; // our windows are never targets
+static Atom net_active_window;
+
+static bool focus_usable(Display* dpy,Window w){
+    if(w==None||w==PointerRoot||w==DefaultRootWindow(dpy)) return false;
+    for(int i=0;i<3;i++) if(w==focus_own[i]) return false;
+    return true;
+}
+
+static int toplevel_find(Window w){
+    for(int i=0;i<ntoplevels;i++) if(toplevels[i].w==w) return i;
+    return -1;
+}
+
+static void toplevel_add(Display* dpy,Window w){
+    if(!focus_usable(dpy,w)||toplevel_find(w)>=0) return;
+    if(ntoplevels==toplevels_cap){
+        int cap=toplevels_cap?toplevels_cap*2:64;
+        TopLevel* nt=realloc(toplevels,cap*sizeof(TopLevel));
+        if(!nt){ fprintf(stderr,"focus: cannot track window 0x%lx\n",(unsigned long)w); return; }
+        toplevels=nt; toplevels_cap=cap;
+    }
+    toplevels[ntoplevels++]=(TopLevel){w};
+    XSelectInput(dpy,w,EnterWindowMask|LeaveWindowMask|SubstructureNotifyMask);
+}
+
+static void toplevel_remove(Window w){
+    int i=toplevel_find(w);
+    if(i>=0) toplevels[i]=toplevels[--ntoplevels];
+}
+
+static void focus_init(Display* dpy,Window win,Window input,Window launcher){
+    Window root=DefaultRootWindow(dpy), r, p, *children=NULL;
+    unsigned int n=0;
+    focus_own[0]=win; focus_own[1]=input; focus_own[2]=launcher;
+    net_active_window=XInternAtom(dpy,"_NET_ACTIVE_WINDOW",False);
+    XSelectInput(dpy,root,FocusChangeMask|PropertyChangeMask|SubstructureNotifyMask);
+    if(XQueryTree(dpy,root,&r,&p,&children,&n)){
+        for(unsigned int i=0;i<n;i++) toplevel_add(dpy,children[i]);
+        if(children) XFree(children);
+    }
+}
+
+static void focus_sync(Display* dpy,Window* focus){
+    Window fw; int revert;
+    XGetInputFocus(dpy,&fw,&revert);
+    if(focus_usable(dpy,fw)) *focus=fw;
+}
+
+static void focus_enter(Display* dpy,int t,Window* focus){
+    Window target=input_target_under_pointer(dpy,toplevels[t].w);
+    XSetInputFocus(dpy,target,RevertToParent,CurrentTime);
+    *focus=target;
+}
+
+/* Returns true if ev was focus/window-tree bookkeeping. *focus only
+   follows the pointer while the keyboard is visible. */
+static bool focus_handle_event(Display* dpy,XEvent* ev,Window* focus,bool visible){
+    Window root=DefaultRootWindow(dpy);
+    switch(ev->type){
+    case CreateNotify:
+        if(ev->xcreatewindow.parent==root) toplevel_add(dpy,ev->xcreatewindow.window);
+        return true;
+    case DestroyNotify:
+        if(ev->xdestroywindow.event==root) toplevel_remove(ev->xdestroywindow.window);
+        if(ev->xdestroywindow.window==*focus){ *focus=None; focus_sync(dpy,focus); }
+        return true;
+    case ReparentNotify:
+        if(ev->xreparent.event!=root) return true;
+        if(ev->xreparent.parent==root) toplevel_add(dpy,ev->xreparent.window);
+        else toplevel_remove(ev->xreparent.window);
+        return true;
+    case MapNotify: case UnmapNotify:
+    case ConfigureNotify: case GravityNotify: case CirculateNotify:
+        return true; // substructure noise from the root and toplevels
+    case EnterNotify: case LeaveNotify: {
+        // Enter of any kind, or Leave into a child: the pointer is over a
+        // (possibly different) part of this toplevel
+        int t=toplevel_find(ev->xcrossing.window);
+        if(t<0) return false;
+        if(visible && (ev->type==EnterNotify || ev->xcrossing.detail==NotifyInferior))
+            focus_enter(dpy,t,focus);
+        return true;
+    }
+    case PropertyNotify:
+        if(ev->xproperty.window!=root) return false;
+        if(visible && ev->xproperty.atom==net_active_window) focus_sync(dpy,focus);
+        return true;
+    case FocusIn: case FocusOut:
+        if(ev->xfocus.window!=root) return false;
+        if(visible) focus_sync(dpy,focus);
+        return true;
+    }
+    return false;
+}
+
+
+/* Keycodes for every layout key in every layer plus the modifiers we
+   inject, resolved once per layout. MappingNotify/XkbMapNotify mark the
+   table stale; it is rebuilt on the next lookup. Entries are indexed
+   layer*keymap_nkeys+key, matching the layout's layer key arrays. */
+static KeyCode* key_codes=NULL;
+static Key* keymap_keys=NULL;
+static int keymap_nkeys=0, keymap_nlayers=1;
+static KeyCode kc_shift, kc_ctrl, kc_alt, kc_paste;
+static bool keymap_stale=true;
+static int xkb_event_base=-1;
+static int repeat_delay_ms=400, repeat_interval_ms=100; // until XKB says otherwise
+
+static void repeat_rate_refresh(Display* dpy){
+    XkbDescPtr xkb=XkbAllocKeyboard();
+    if(!xkb) return;
+    if(XkbGetControls(dpy,XkbRepeatKeysMask,xkb)==Success && xkb->ctrls){
+        if(xkb->ctrls->repeat_delay>0) repeat_delay_ms=xkb->ctrls->repeat_delay;
+        if(xkb->ctrls->repeat_interval>0) repeat_interval_ms=xkb->ctrls->repeat_interval;
+    }
+    XkbFreeKeyboard(xkb,XkbAllComponentsMask,True);
+}
+
+/* Keysyms the keymap lacks are typed through spare keycodes (bound to no
+   symbols) remapped on demand. A mapping stays in place after use, so a
+   repeated symbol costs no round-trip; the least recently used spare is
+   recycled, but never within SPARE_HOLD_MS of its last press so the target
+   has consumed the key first. Spares are cleared again at exit. */
+#define SPARE_MAX 32
+#define SPARE_HOLD_MS 500
+typedef struct { KeyCode kc; KeySym ks; long used; } Spare; // ks NoSymbol: unassigned
+static Spare spares[SPARE_MAX];
+static int nspares=0;
+static Display* spare_dpy=NULL; // for the exit restore
+
+static int spare_find_kc(KeyCode kc){
+    for(int i=0;i<nspares;i++) if(spares[i].kc==kc) return i;
+    return -1;
+}
+
+// Sync the pool with the server map: drop spares someone else claimed,
+// adopt keycodes that have become empty.
+static void spare_scan(Display* dpy){
+    int min,max,per;
+    XDisplayKeycodes(dpy,&min,&max);
+    KeySym* map=XGetKeyboardMapping(dpy,(KeyCode)min,max-min+1,&per);
+    if(!map) return;
+    for(int i=0;i<nspares;){
+        KeySym cur=map[(spares[i].kc-min)*per];
+        if(cur==NoSymbol||cur==spares[i].ks) i++;
+        else spares[i]=spares[--nspares];
+    }
+    for(int kc=min;kc<=max && nspares<SPARE_MAX;kc++){
+        bool empty=true;
+        for(int c=0;c<per;c++) if(map[(kc-min)*per+c]!=NoSymbol){ empty=false; break; }
+        if(empty && spare_find_kc(kc)<0) spares[nspares++]=(Spare){(KeyCode)kc,NoSymbol,0};
+    }
+    XFree(map);
+}
+
+static KeyCode spare_keycode(Display* dpy,KeySym ks){
+    long now=now_ms();
+    int lru=-1;
+    if(ks==NoSymbol) return 0;
+    for(int i=0;i<nspares;i++){
+        if(spares[i].ks==ks){ spares[i].used=now; return spares[i].kc; }
+        if(spares[i].ks!=NoSymbol && now-spares[i].used<SPARE_HOLD_MS) continue;
+        if(lru<0||spares[i].used<spares[lru].used) lru=i;
+    }
+    if(lru<0){ fprintf(stderr,"No spare keycode free for keysym 0x%lx\n",(unsigned long)ks); return 0; }
+    KeySym syms[2]={ks,ks}; // both levels: types ks with or without Shift
+    XChangeKeyboardMapping(dpy,spares[lru].kc,2,syms,1);
+    XSync(dpy,False); // mapping in effect before the injector's events
+    spares[lru].ks=ks; spares[lru].used=now;
+    // key_codes keeps spares at 0 and text bursts never use them, so the
+    // table stays valid; the resulting notifies are skipped as our own
+    return spares[lru].kc;
+}
+
+static void spare_restore(void){
+    KeySym none[2]={NoSymbol,NoSymbol};
+    if(!spare_dpy) return;
+    for(int i=0;i<nspares;i++)
+        if(spares[i].ks!=NoSymbol) XChangeKeyboardMapping(spare_dpy,spares[i].kc,2,none,1);
+    XSync(spare_dpy,False);
+}
+
+static void keymap_init(Display* dpy){
+    int op,err,major=XkbMajorVersion,minor=XkbMinorVersion;
+    spare_dpy=dpy;
+    atexit(spare_restore);
+    if(XkbQueryExtension(dpy,&op,&xkb_event_base,&err,&major,&minor)){
+        XkbSelectEvents(dpy,XkbUseCoreKbd,XkbMapNotifyMask|XkbControlsNotifyMask,
+                        XkbMapNotifyMask|XkbControlsNotifyMask);
+        repeat_rate_refresh(dpy);
+    } else
+        xkb_event_base=-1; // core MappingNotify only (always delivered)
+}
+
+/* "text" keys: each character as keycode + shift, precomputed with the
+   keycode table. Strings that are long or need a symbol the map lacks are
+   pasted through the clipboard instead. */
+#define TEXT_BURST_MAX 256
+typedef struct { KeyCode kc; bool shift; } TextStroke;
+typedef struct { TextStroke* s; int n; bool paste; } TextSeq;
+static TextSeq* key_text=NULL;
+static int key_text_n=0;
+
+static KeySym text_keysym(unsigned int cp){
+    if(cp=='\n') return XK_Return;
+    if(cp=='\t') return XK_Tab;
+    if((cp>=0x20&&cp<=0x7e)||(cp>=0xa0&&cp<=0xff)) return cp; // Latin-1 keysyms are the code point
+    return 0x1000000|cp;
+}
+
+static void text_seq_build(Display* dpy,TextSeq* T,const char* text){
+    int cap=0;
+    T->s=NULL; T->n=0; T->paste=false;
+    for(const char* p=text;*p;){
+        KeySym ks=text_keysym(utf8_next(&p));
+        KeyCode kc=XKeysymToKeycode(dpy,ks);
+        bool shift=false;
+        if(kc && spare_find_kc(kc)<0 && XkbKeycodeToKeysym(dpy,kc,0,0)!=ks){
+            shift=XkbKeycodeToKeysym(dpy,kc,0,1)==ks;
+            if(!shift) kc=0; // needs another level/group
+        }
+        if(!kc||spare_find_kc(kc)>=0||T->n==TEXT_BURST_MAX){ T->paste=true; break; }
+        if(T->n==cap){
+            cap=cap?cap*2:32;
+            TextStroke* ns=realloc(T->s,cap*sizeof(TextStroke));
+            if(!ns){ T->paste=true; break; }
+            T->s=ns;
+        }
+        T->s[T->n++]=(TextStroke){kc,shift};
+    }
+    if(T->paste){ free(T->s); T->s=NULL; T->n=0; }
+}
+
+static void keymap_rebuild(Display* dpy){
+    int total=keymap_nkeys*keymap_nlayers;
+    KeyCode* kc=realloc(key_codes,(total>0?total:1)*sizeof(KeyCode));
+    if(!kc) return;
+    key_codes=kc;
+    spare_scan(dpy);
+    for(int i=0;i<total;i++){
+        key_codes[i]=XKeysymToKeycode(dpy,keymap_keys[i].keysym);
+        // spares stay 0 here so every use goes through the pool's LRU
+        if(spare_find_kc(key_codes[i])>=0) key_codes[i]=0;
+    }
+    for(int i=0;i<key_text_n;i++) free(key_text[i].s);
+    free(key_text);
+    key_text=calloc(total>0?total:1,sizeof(TextSeq));
+    key_text_n=key_text?total:0;
+    for(int i=0;i<key_text_n;i++)
+        if(keymap_keys[i].text) text_seq_build(dpy,&key_text[i],key_str(keymap_keys[i].text));
+    kc_paste=XKeysymToKeycode(dpy,XK_v);
+    kc_shift=XKeysymToKeycode(dpy,XK_Shift_L);
+    kc_ctrl=XKeysymToKeycode(dpy,XK_Control_L);
+    kc_alt=XKeysymToKeycode(dpy,XK_Alt_L);
+    keymap_stale=false;
+}
+
+// new layout: n keys per layer, nlayers arrays back to back from keys,
+// which must stay valid until the next call
+static void keymap_build(Display* dpy,Key* keys,int n,int nlayers){
+    keymap_keys=keys; keymap_nkeys=n; keymap_nlayers=nlayers;
+    keymap_rebuild(dpy);
+}
+
+static KeyCode key_keycode(Display* dpy,int i,int layer){
+    if(keymap_stale) keymap_rebuild(dpy);
+    if(i<0||i>=keymap_nkeys||layer<0||layer>=keymap_nlayers) return 0;
+    i+=layer*keymap_nkeys;
+    if(key_codes[i]) return key_codes[i];
+    return spare_keycode(dpy,keymap_keys[i].keysym);
+}
+
+static KeyCode mod_keycode(Display* dpy,KeySym ks){
+    if(keymap_stale) keymap_rebuild(dpy);
+    return ks==XK_Shift_L?kc_shift:ks==XK_Control_L?kc_ctrl:ks==XK_Alt_L?kc_alt:0;
+}
+
+// A change to a single spare keycode is one of our own remaps
+static bool keymap_self_change(int first,int count){
+    return count==1 && spare_find_kc((KeyCode)first)>=0;
+}
+
+static bool keymap_handle_event(Display* dpy,XEvent* ev){
+    if(ev->type==MappingNotify){
+        XRefreshKeyboardMapping(&ev->xmapping);
+        if(ev->xmapping.request!=MappingPointer &&
+           !(ev->xmapping.request==MappingKeyboard &&
+             keymap_self_change(ev->xmapping.first_keycode,ev->xmapping.count)))
+            keymap_stale=true;
+        return true;
+    }
+    if(xkb_event_base>=0 && ev->type==xkb_event_base+XkbEventCode &&
+       ((XkbAnyEvent*)ev)->xkb_type==XkbMapNotify){
+        XkbMapNotifyEvent* m=(XkbMapNotifyEvent*)ev;
+        XkbRefreshKeyboardMapping(m);
+        // core remaps also report the key's actions/behaviour, all per-key
+        int per_key=XkbKeySymsMask|XkbKeyActionsMask|XkbKeyBehaviorsMask|XkbExplicitComponentsMask|
+                    XkbModifierMapMask|XkbVirtualModMapMask;
+        if(!((m->changed&XkbKeySymsMask) && !(m->changed&~per_key) &&
+             keymap_self_change(m->first_key_sym,m->num_key_syms)))
+            keymap_stale=true;
+        return true;
+    }
+    if(xkb_event_base>=0 && ev->type==xkb_event_base+XkbEventCode &&
+       ((XkbAnyEvent*)ev)->xkb_type==XkbControlsNotify){
+        repeat_rate_refresh(dpy); // e.g. xset r rate
+        return true;
+    }
+    return false;
+}
+
+/* Key injection runs on its own thread with its own Display, so a swap
+   blocked on vsync never delays a keystroke. The main thread is the only
+   producer and the injector the only consumer of a lock-free ring; an
+   eventfd wakes the injector after each key sequence. Each Display is used
+   by one thread only. Without the thread, events go out on the main
+   connection as before. */
+#define INJECT_RING 1024 // power of two
+typedef struct { KeyCode kc; bool down; int trace; } InjectAct; // kc 0: latency marker
+static InjectAct inject_ring[INJECT_RING];
+static _Atomic unsigned inject_head=0, inject_tail=0; // head: producer, tail: consumer
+static Display* inject_dpy=NULL;
+static int inject_fd=-1;
+
+static void* inject_main(void* arg){
+    (void)arg;
+    for(;;){
+        uint64_t v;
+        if(read(inject_fd,&v,sizeof(v))<0) continue; // blocks until woken
+        unsigned t=atomic_load_explicit(&inject_tail,memory_order_relaxed);
+        unsigned h=atomic_load_explicit(&inject_head,memory_order_acquire);
+        int marks[16], nmarks=0;
+        for(;t!=h;t++){
+            InjectAct a=inject_ring[t&(INJECT_RING-1)];
+            if(a.kc){ XTestFakeKeyEvent(inject_dpy,a.kc,a.down,0); continue; }
+            lat_stamp(a.trace,LAT_SENT);
+            if(nmarks<16) marks[nmarks++]=a.trace;
+        }
+        atomic_store_explicit(&inject_tail,t,memory_order_release);
+        XFlush(inject_dpy);
+        for(int i=0;i<nmarks;i++) lat_stamp(marks[i],LAT_FLUSHED);
+    }
+    return NULL;
+}
+
+static void inject_init(void){
+    pthread_t th;
+    inject_fd=eventfd(0,EFD_CLOEXEC);
+    inject_dpy=XOpenDisplay(NULL);
+    if(inject_fd<0||!inject_dpy||pthread_create(&th,NULL,inject_main,NULL)!=0){
+        fprintf(stderr,"Injection thread unavailable; injecting from the main loop\n");
+        if(inject_dpy) XCloseDisplay(inject_dpy);
+        inject_dpy=NULL;
+        return;
+    }
+    pthread_detach(th);
+}
+
+static void inject_push(InjectAct a){
+    unsigned h=atomic_load_explicit(&inject_head,memory_order_relaxed);
+    if(h-atomic_load_explicit(&inject_tail,memory_order_acquire)==INJECT_RING){
+        // full mid-sequence: wake the injector to drain it, or nothing will
+        uint64_t one=1;
+        ssize_t r=write(inject_fd,&one,sizeof(one)); (void)r;
+        while(h-atomic_load_explicit(&inject_tail,memory_order_acquire)==INJECT_RING)
+            sched_yield(); // never drop a key (a lost release would stick)
+    }
+    inject_ring[h&(INJECT_RING-1)]=a;
+    atomic_store_explicit(&inject_head,h+1,memory_order_release);
+}
+
+static void inject_key(Display* dpy,KeyCode kc,bool down){
+    if(!kc) return;
+    if(!inject_dpy){ XTestFakeKeyEvent(dpy,kc,down,0); return; }
+    inject_push((InjectAct){kc,down,LAT_NONE});
+}
+
+// end of a key sequence: hand it to the injector (or flush it ourselves);
+// trace is stamped when the sequence is sent and again once flushed
+static void inject_commit(Display* dpy,int trace){
+    uint64_t one=1;
+    if(!inject_dpy){
+        lat_stamp(trace,LAT_SENT);
+        XFlush(dpy);
+        lat_stamp(trace,LAT_FLUSHED);
+        return;
+    }
+    if(trace!=LAT_NONE) inject_push((InjectAct){0,false,trace});
+    ssize_t r=write(inject_fd,&one,sizeof(one)); (void)r;
+}
+
+/* Clipboard fallback for "text" keys: own CLIPBOARD with the string and
+   send Ctrl+V. Requests are answered from the main event loop. */
+static Window clip_win=None;
+static Atom clip_atom, clip_targets, clip_utf8;
+static char* clip_text=NULL;
+
+static void clip_init(Display* dpy,Window owner){
+    clip_win=owner;
+    clip_atom=XInternAtom(dpy,"CLIPBOARD",False);
+    clip_targets=XInternAtom(dpy,"TARGETS",False);
+    clip_utf8=XInternAtom(dpy,"UTF8_STRING",False);
+}
+
+static bool clip_handle_event(Display* dpy,XEvent* ev){
+    if(ev->type==SelectionClear){
+        if(ev->xselectionclear.selection==clip_atom){ free(clip_text); clip_text=NULL; }
+        return true;
+    }
+    if(ev->type!=SelectionRequest) return false;
+    XSelectionRequestEvent* r=&ev->xselectionrequest;
+    XSelectionEvent reply={0};
+    reply.type=SelectionNotify; reply.display=dpy; reply.requestor=r->requestor;
+    reply.selection=r->selection; reply.target=r->target; reply.time=r->time;
+    reply.property=None;
+    Atom prop=r->property!=None?r->property:r->target; // obsolete requestors
+    if(clip_text && r->selection==clip_atom){
+        if(r->target==clip_targets){
+            Atom t[3]={clip_targets,clip_utf8,XA_STRING};
+            XChangeProperty(dpy,r->requestor,prop,XA_ATOM,32,PropModeReplace,(unsigned char*)t,3);
+            reply.property=prop;
+        } else if(r->target==clip_utf8||r->target==XA_STRING){
+            XChangeProperty(dpy,r->requestor,prop,r->target,8,PropModeReplace,
+                            (unsigned char*)clip_text,(int)strlen(clip_text));
+            reply.property=prop;
+        }
+    }
+    XSendEvent(dpy,r->requestor,False,0,(XEvent*)&reply);
+    return true;
+}
+
+static void clip_paste(Display* dpy,const char* text,int trace){
+    if(clip_win==None||!kc_ctrl||!kc_paste) return;
+    free(clip_text);
+    clip_text=strdup(text);
+    XSetSelectionOwner(dpy,clip_atom,clip_win,CurrentTime);
+    XSync(dpy,False); // own the selection before the paste arrives
+    inject_key(dpy,kc_ctrl,true);
+    inject_key(dpy,kc_paste,true);
+    inject_key(dpy,kc_paste,false);
+    inject_key(dpy,kc_ctrl,false);
+    inject_commit(dpy,trace);
+}
+
+// Type key i's text in a layer: one batched XTest burst, a single flush
+static void text_send(Display* dpy,int i,int layer,int trace){
+    if(keymap_stale) keymap_rebuild(dpy);
+    if(i<0||i>=keymap_nkeys) return;
+    i+=layer*keymap_nkeys;
+    if(i>=key_text_n||!keymap_keys[i].text) return;
+    TextSeq* T=&key_text[i];
+    if(T->paste){ clip_paste(dpy,key_str(keymap_keys[i].text),trace); return; }
+    bool sh=false;
+    for(int k=0;k<T->n;k++){
+        if(T->s[k].shift!=sh && kc_shift){ sh=T->s[k].shift; inject_key(dpy,kc_shift,sh); }
+        inject_key(dpy,T->s[k].kc,true);
+        inject_key(dpy,T->s[k].kc,false);
+    }
+    if(sh) inject_key(dpy,kc_shift,false);
+    inject_commit(dpy,trace);
+}
+
+/* Key repeat: a min-heap of held keys keyed by their next deadline, so a
+   wakeup only touches keys that are due. The modifiers that applied to
+   the original press are kept and re-pressed around every repeat. */
+enum { REP_SHIFT=1, REP_CTRL=2, REP_ALT=4 };
+#define REPEAT_MAX 256
+typedef struct { long due; int key; unsigned char mods, layer; } RepeatEnt;
+static RepeatEnt repeat_heap[REPEAT_MAX];
+static int repeat_n=0;
+
+static void repeat_swap(int a,int b){ RepeatEnt t=repeat_heap[a]; repeat_heap[a]=repeat_heap[b]; repeat_heap[b]=t; }
+
+static void repeat_sift_up(int i){
+    while(i>0 && repeat_heap[(i-1)/2].due>repeat_heap[i].due){ repeat_swap(i,(i-1)/2); i=(i-1)/2; }
+}
+
+static void repeat_sift_down(int i){
+    for(;;){
+        int l=2*i+1, r=l+1, m=i;
+        if(l<repeat_n && repeat_heap[l].due<repeat_heap[m].due) m=l;
+        if(r<repeat_n && repeat_heap[r].due<repeat_heap[m].due) m=r;
+        if(m==i) return;
+        repeat_swap(i,m); i=m;
+    }
+}
+
+static void repeat_cancel(int key){
+    for(int i=0;i<repeat_n;i++) if(repeat_heap[i].key==key){
+        repeat_heap[i]=repeat_heap[--repeat_n];
+        if(i<repeat_n){ repeat_sift_up(i); repeat_sift_down(i); }
+        return;
+    }
+}
+
+static void repeat_clear(void){ repeat_n=0; }
+
+static int key_repeat_delay(const Key* K){ return K->repeat_delay?K->repeat_delay:repeat_delay_ms; }
+static int key_repeat_interval(const Key* K){ return K->repeat_interval>0?K->repeat_interval:repeat_interval_ms; }
+
+static void repeat_start(const Key* K,int key,unsigned char mods,int layer){
+    repeat_cancel(key);
+    if(K->repeat_delay<0||repeat_n==REPEAT_MAX) return;
+    repeat_heap[repeat_n]=(RepeatEnt){now_ms()+key_repeat_delay(K),key,mods,(unsigned char)layer};
+    repeat_sift_up(repeat_n++);
+}
+
+// Fire everything due; returns the next deadline (-1: nothing held)
+static long repeat_run(Display* dpy,bool can_inject){
+    long now=now_ms();
+    while(repeat_n && repeat_heap[0].due<=now){
+        RepeatEnt* e=&repeat_heap[0];
+        if(can_inject){
+            KeyCode kc=key_keycode(dpy,e->key,e->layer);
+            KeyCode skc=(e->mods&REP_SHIFT)?mod_keycode(dpy,XK_Shift_L):0;
+            KeyCode ckc=(e->mods&REP_CTRL)?mod_keycode(dpy,XK_Control_L):0;
+            KeyCode akc=(e->mods&REP_ALT)?mod_keycode(dpy,XK_Alt_L):0;
+            inject_key(dpy,skc,true); inject_key(dpy,ckc,true); inject_key(dpy,akc,true);
+            inject_key(dpy,kc,true); inject_key(dpy,kc,false);
+            inject_key(dpy,akc,false); inject_key(dpy,ckc,false); inject_key(dpy,skc,false);
+            inject_commit(dpy,LAT_NONE);
+        }
+        int iv=key_repeat_interval(&keymap_keys[e->layer*keymap_nkeys+e->key]);
+        e->due+=iv;
+        if(e->due<=now) e->due=now+iv; // fell behind (blocked loop): don't burst
+        repeat_sift_down(0);
+    }
+    return repeat_n?repeat_heap[0].due:-1;
+}
+
+/* Hit-test index: a uniform grid over the window whose cells list, in
+   layout order, the keys overlapping them. Keys spanning several rows
+   (reserved spans) just appear in every cell they cover. A lookup tests
+   one cell's keys, so it returns the same key as a linear scan would. */
+#define HIT_GRID_MAX 1024 // cells per axis
+typedef struct { int cols,rows; float cw,ch; int* start; int* keys; } HitGrid;
+static HitGrid hit_grid;
+
+static void hit_cells(const HitGrid* g,const Key* K,int* c0,int* c1,int* r0,int* r1){
+    *c0=(int)floorf(K->x/g->cw); *c1=(int)floorf((K->x+K->w)/g->cw);
+    *r0=(int)floorf(K->y/g->ch); *r1=(int)floorf((K->y+K->h)/g->ch);
+    if(*c0<0) *c0=0;
+    if(*r0<0) *r0=0;
+    if(*c1>=g->cols) *c1=g->cols-1;
+    if(*r1>=g->rows) *r1=g->rows-1;
+}
+
+static void hit_grid_build(HitGrid* g,const Key* keys,int n,int win_w,int win_h){
+    free(g->start); free(g->keys);
+    memset(g,0,sizeof(*g));
+    if(n<=0||win_w<=0||win_h<=0) return;
+    double area=0;
+    for(int i=0;i<n;i++) area+=keys[i].w*keys[i].h;
+    float side=sqrtf((float)(area/n)); // ~one key per cell
+    if(side<4.0f) side=4.0f;
+    g->cols=(int)ceilf(win_w/side); g->rows=(int)ceilf(win_h/side);
+    if(g->cols>HIT_GRID_MAX) g->cols=HIT_GRID_MAX;
+    if(g->rows>HIT_GRID_MAX) g->rows=HIT_GRID_MAX;
+    g->cw=(float)win_w/g->cols; g->ch=(float)win_h/g->rows;
+    int ncell=g->cols*g->rows;
+    g->start=calloc(ncell+1,sizeof(int));
+    int* fill=malloc(ncell*sizeof(int));
+    if(!g->start||!fill){ free(g->start); free(fill); g->start=NULL; return; }
+    int c0,c1,r0,r1;
+    for(int i=0;i<n;i++){ // count, then prefix-sum into offsets
+        hit_cells(g,&keys[i],&c0,&c1,&r0,&r1);
+        for(int r=r0;r<=r1;r++) for(int c=c0;c<=c1;c++) g->start[r*g->cols+c+1]++;
+    }
+    for(int c=0;c<ncell;c++) g->start[c+1]+=g->start[c];
+    memcpy(fill,g->start,ncell*sizeof(int));
+    g->keys=malloc((g->start[ncell]>0?g->start[ncell]:1)*sizeof(int));
+    if(!g->keys){ free(g->start); free(fill); g->start=NULL; return; }
+    for(int i=0;i<n;i++){
+        hit_cells(g,&keys[i],&c0,&c1,&r0,&r1);
+        for(int r=r0;r<=r1;r++) for(int c=c0;c<=c1;c++) g->keys[fill[r*g->cols+c]++]=i;
+    }
+    free(fill);
+}
+
+static int hit_test(const HitGrid* g,const Key* keys,int px,int py){
+    if(!g->start||px<0||py<0) return -1;
+    int c=(int)(px/g->cw), r=(int)(py/g->ch);
+    if(c>=g->cols||r>=g->rows) return -1;
+    int cell=r*g->cols+c;
+    for(int k=g->start[cell];k<g->start[cell+1];k++){
+        const Key* K=&keys[g->keys[k]];
+        if(px>=K->x && px<K->x+K->w && py>=K->y && py<K->y+K->h) return g->keys[k];
+    }
+    return -1;
+}
+
+static int hit_test_linear(const Key* keys,int n,int px,int py){
+    for(int i=0;i<n;i++)
+        if(px>=keys[i].x && px<keys[i].x+keys[i].w && py>=keys[i].y && py<keys[i].y+keys[i].h) return i;
+    return -1;
+}
+
+/* --bench-hittest: synthetic grids (every 13th key two rows tall) on a
+   1366x768 window, random points, linear scan vs. the grid index. */
+static double bench_lookups_per_s(const HitGrid* g,const Key* keys,int n,const int* pts,int npts,long* sink){
+    struct timespec a,b;
+    long done=0;
+    double dt=0;
+    clock_gettime(CLOCK_MONOTONIC,&a);
+    do{
+        for(int i=0;i<npts;i++)
+            *sink+=g?hit_test(g,keys,pts[2*i],pts[2*i+1]):hit_test_linear(keys,n,pts[2*i],pts[2*i+1]);
+        done+=npts;
+        clock_gettime(CLOCK_MONOTONIC,&b);
+        dt=(b.tv_sec-a.tv_sec)+(b.tv_nsec-a.tv_nsec)/1e9;
+    }while(dt<0.25);
+    return done/dt;
+}
+
+static void bench_hittest(void){
+    static const int sizes[3]={100,1000,10000};
+    const int W=1366,H=768,NPTS=4096;
+    static int pts[2*4096];
+    unsigned int rng=12345;
+    long sink=0;
+    for(int i=0;i<2*NPTS;i++){ rng^=rng<<13; rng^=rng>>17; rng^=rng<<5; pts[i]=rng%(i&1?H:W); }
+    for(int t=0;t<3;t++){
+        int want=sizes[t];
+        int cols=(int)ceil(sqrt(want*(double)W/H)), rows=(want*11/10+cols-1)/cols+1;
+        float cw=(float)W/cols, ch=(float)H/rows;
+        Key* keys=calloc(want,sizeof(Key));
+        bool* taken=calloc((size_t)cols*rows,sizeof(bool));
+        int n=0;
+        for(int r=0;r<rows&&n<want;r++) for(int c=0;c<cols&&n<want;c++){
+            if(taken[r*cols+c]) continue;
+            Key* K=&keys[n];
+            K->x=c*cw; K->y=r*ch; K->w=cw-2; K->h=ch-2;
+            if(n%13==0 && r+1<rows){ K->h=2*ch-2; taken[(r+1)*cols+c]=true; }
+            n++;
+        }
+        HitGrid g={0};
+        hit_grid_build(&g,keys,n,W,H);
+        int mismatch=0;
+        for(int i=0;i<NPTS;i++)
+            if(hit_test(&g,keys,pts[2*i],pts[2*i+1])!=hit_test_linear(keys,n,pts[2*i],pts[2*i+1])) mismatch++;
+        double lin=bench_lookups_per_s(NULL,keys,n,pts,NPTS,&sink);
+        double grid=bench_lookups_per_s(&g,keys,n,pts,NPTS,&sink);
+        printf("%6d keys: linear %12.0f lookups/s, grid %12.0f lookups/s (%dx%d cells, %d mismatches)\n",
+               n,lin,grid,g.cols,g.rows,mismatch);
+        free(g.start); free(g.keys); free(taken); free(keys);
+    }
+    if(sink==42) printf("\n"); // keep the lookups observable
+}
+
+/* Touch input. Core button events and XI2 touches are normalised into
+   one press/release with a pointer id; each id remembers the key it went
+   down on so overlapping presses release the right key. The core pointer
+   is id TOUCH_POINTER. */
+enum { PTR_NONE, PTR_PRESS, PTR_RELEASE };
+#define TOUCH_MAX 16
+#define TOUCH_POINTER (-1L)
+typedef struct { long id; int key; } TouchSlot;
+static TouchSlot touch_slots[TOUCH_MAX];
+static int ntouch=0;
+static int xi_opcode=-1; // -1: no XI 2.2, core events only
+
+static void touch_bind(long id,int key){
+    for(int i=0;i<ntouch;i++) if(touch_slots[i].id==id){ touch_slots[i].key=key; return; }
+    if(ntouch==TOUCH_MAX){ // lost an end event somewhere; forget the oldest
+        memmove(touch_slots,touch_slots+1,(TOUCH_MAX-1)*sizeof(TouchSlot));
+        ntouch--;
+    }
+    touch_slots[ntouch++]=(TouchSlot){id,key};
+}
+
+// key the id went down on (-1 if none); the binding is dropped
+static int touch_take(long id){
+    for(int i=0;i<ntouch;i++) if(touch_slots[i].id==id){
+        int key=touch_slots[i].key;
+        touch_slots[i]=touch_slots[--ntouch];
+        return key;
+    }
+    return -1;
+}
+
+static void touch_reset(void){ ntouch=0; }
+
+static bool xi2_init(Display* dpy,Window w){
+    int ev,err,major=2,minor=2;
+    if(!XQueryExtension(dpy,"XInputExtension",&xi_opcode,&ev,&err)||
+       XIQueryVersion(dpy,&major,&minor)!=Success||major<2||(major==2&&minor<2)){
+        xi_opcode=-1;
+        return false;
+    }
+    unsigned char bits[XIMaskLen(XI_TouchEnd)]={0};
+    XISetMask(bits,XI_TouchBegin);
+    XISetMask(bits,XI_TouchUpdate);
+    XISetMask(bits,XI_TouchEnd);
+    XIEventMask mask={XIAllMasterDevices,sizeof(bits),bits};
+    XISelectEvents(dpy,w,&mask,1);
+    return true;
+}
+
+/* Map core buttons on the input window and XI2 touches to PTR_*.
+   Touch updates are consumed; a touch stays on the key it started on. */
+static int pointer_event(Display* dpy,XEvent* ev,Window input,int* x,int* y,long* id,Time* t){
+    *id=TOUCH_POINTER;
+    if(ev->type==ButtonPress && ev->xany.window==input){ *x=ev->xbutton.x; *y=ev->xbutton.y; *t=ev->xbutton.time; return PTR_PRESS; }
+    if(ev->type==ButtonRelease){ *x=ev->xbutton.x; *y=ev->xbutton.y; *t=ev->xbutton.time; return PTR_RELEASE; }
+    if(ev->type!=GenericEvent||ev->xcookie.extension!=xi_opcode||!XGetEventData(dpy,&ev->xcookie))
+        return PTR_NONE;
+    XIDeviceEvent* de=ev->xcookie.data;
+    int kind=ev->xcookie.evtype==XI_TouchBegin?PTR_PRESS:ev->xcookie.evtype==XI_TouchEnd?PTR_RELEASE:PTR_NONE;
+    *x=(int)de->event_x; *y=(int)de->event_y; *id=de->detail; *t=de->time;
+    XFreeEventData(dpy,&ev->xcookie);
+    return kind;
 }
 
 
@@ -712,7 +2614,7 @@ static void draw_launcher_icon(int win_w, int win_h) {
     glEnableVertexAttribArray(rect_aPos);
     glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&body[0].r);
     glEnableVertexAttribArray(rect_aCol);
-    glDrawArrays(GL_TRIANGLES,0,6);
+    draw_arrays(GL_TRIANGLES,0,6);
 
     // Inner keys (even darker grey)
     float r_key=0.12f, g_key=0.12f, b_key=0.12f;
@@ -728,7 +2630,7 @@ static void draw_launcher_icon(int win_w, int win_h) {
             glEnableVertexAttribArray(rect_aPos);
             glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&key[0].r);
             glEnableVertexAttribArray(rect_aCol);
-            glDrawArrays(GL_TRIANGLES,0,6);
+            draw_arrays(GL_TRIANGLES,0,6);
         }
     }
 
@@ -741,18 +2643,345 @@ static void draw_launcher_icon(int win_w, int win_h) {
     glEnableVertexAttribArray(rect_aPos);
     glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(RectVtx),&spacebar[0].r);
     glEnableVertexAttribArray(rect_aCol);
-    glDrawArrays(GL_TRIANGLES,0,6);
+    draw_arrays(GL_TRIANGLES,0,6);
+}
+
+
+
+/* Glyph part of the icons: the 'x' inside Backspace. The strokes are in
+   the key mesh; this only queues text. */
+static void draw_key_icon_text(const Key* K) {
+    if (K->keysym != XK_BackSpace) return;
+    float cx,cy,box_w,box_h,scale;
+    backspace_box(K,&cx,&cy,&box_w,&box_h,&scale);
+    float tx = cx + 1.0f - 0.01f;
+    float ty = cy + box_h*0.76f; // lowered baseline
+    draw_text("x", tx, ty, scale);
+}
+
+
+/* Whole keyboard face: key mesh (faces + icons), then labels. pressed==NULL
+   draws everything released (used to fill the modifier layers). */
+static void draw_keyboard(int win_w,int win_h,Key* keys,int n,const unsigned char* pressed){
+    prof_phase(PROF_KEYS);
+    draw_keys(win_w,win_h,keys,n,pressed);
+    prof_phase(PROF_LABELS);
+    for(int i=0;i<n;i++) draw_key_labels(&keys[i],shift_down,caps_down);
+    prof_phase(PROF_ICONS);
+    for(int i=0;i<n;i++) draw_key_icon_text(&keys[i]);
+    prof_phase(PROF_LABELS);
+    text_batch_flush(win_w,win_h);
+}
+
+/* Pre-rendered modifier layers. The released face of the keyboard only
+   depends on the active layout layer and caps/shift, so each of those
+   states is rendered once into an offscreen texture. A frame is then one
+   fullscreen quad plus the keys that are held. Layers are filled on first
+   use and dropped when the layout changes; states past the table are
+   drawn directly. */
+#define KEY_LAYER_STATES 32
+typedef struct { GLuint tex,fbo; bool valid; } KeyLayer;
+static KeyLayer key_layers[KEY_LAYER_STATES];
+static bool key_layers_broken=false; // FBOs unusable: always draw directly
+
+static const char* BLIT_VS="attribute vec2 aPos;attribute vec2 aUV;varying vec2 vUV;void main(){gl_Position=vec4(aPos,0.0,1.0);vUV=aUV;}";
+static const char* BLIT_FS="precision mediump float;varying vec2 vUV;uniform sampler2D uTex;void main(){gl_FragColor=texture2D(uTex,vUV);}";
+static GLuint blit_prog; static GLint blit_aPos,blit_aUV,blit_uTex;
+
+static int key_layer_index(void){
+    return layer_active*4|(caps_down?2:0)|(shift_down?1:0);
+}
+
+static void key_layers_invalidate(void){
+    for(int i=0;i<KEY_LAYER_STATES;i++) key_layers[i].valid=false;
+}
+
+static bool key_layer_render(KeyLayer* L,int win_w,int win_h,Key* keys,int n){
+    if(!L->tex){
+        glGenTextures(1,&L->tex);
+        glBindTexture(GL_TEXTURE_2D,L->tex);
+        glTexImage2D(GL_TEXTURE_2D,0,GL_RGBA,win_w,win_h,0,GL_RGBA,GL_UNSIGNED_BYTE,NULL);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+        glGenFramebuffers(1,&L->fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER,L->fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,GL_TEXTURE_2D,L->tex,0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER)!=GL_FRAMEBUFFER_COMPLETE){
+            fprintf(stderr,"Layer FBO incomplete, drawing directly\n");
+            glBindFramebuffer(GL_FRAMEBUFFER,0);
+            key_layers_broken=true;
+            return false;
+        }
+    } else {
+        glBindFramebuffer(GL_FRAMEBUFFER,L->fbo);
+    }
+    GLboolean scissor=glIsEnabled(GL_SCISSOR_TEST); // layers are always drawn whole
+    glDisable(GL_SCISSOR_TEST);
+    glViewport(0,0,win_w,win_h);
+    glClear(GL_COLOR_BUFFER_BIT);
+    draw_keyboard(win_w,win_h,keys,n,NULL);
+    glBindFramebuffer(GL_FRAMEBUFFER,0);
+    if(scissor) glEnable(GL_SCISSOR_TEST);
+    L->valid=true;
+    return true;
+}
+
+/* Composite the layer for the current modifier state. False means the
+   caller has to draw the keyboard itself. */
+static bool draw_key_layer(int win_w,int win_h,Key* keys,int n){
+    static const GLfloat quad[16]={-1,-1,0,0, 1,-1,1,0, 1,1,1,1, -1,1,0,1};
+    if(key_layers_broken||!blit_prog) return false;
+    if(key_layer_index()>=KEY_LAYER_STATES) return false;
+    KeyLayer* L=&key_layers[key_layer_index()];
+    if(!L->valid && !key_layer_render(L,win_w,win_h,keys,n)) return false;
+
+    prof_phase(PROF_KEYS);
+    glUseProgram(blit_prog);
+    glUniform1i(blit_uTex,0);
+    glBindTexture(GL_TEXTURE_2D,L->tex);
+    glVertexAttribPointer(blit_aPos,2,GL_FLOAT,GL_FALSE,4*sizeof(GLfloat),quad);
+    glEnableVertexAttribArray(blit_aPos);
+    glVertexAttribPointer(blit_aUV,2,GL_FLOAT,GL_FALSE,4*sizeof(GLfloat),quad+2);
+    glEnableVertexAttribArray(blit_aUV);
+    glDisable(GL_BLEND);
+    draw_arrays(GL_TRIANGLE_FAN,0,4);
+    glEnable(GL_BLEND);
+    return true;
+}
+
+/* Held keys on top of a layer: pressed face and icon, then label */
+static void draw_pressed_overlays(int win_w,int win_h,Key* keys,int n,const unsigned char* pressed){
+    int any=0;
+    prof_phase(PROF_KEYS);
+    for(int i=0;i<n;i++)
+        if(key_is_down(&keys[i],pressed[i])){ draw_key(win_w,win_h,i,1); any=1; }
+    if(!any) return;
+    prof_phase(PROF_LABELS);
+    for(int i=0;i<n;i++)
+        if(key_is_down(&keys[i],pressed[i])) draw_key_labels(&keys[i],shift_down,caps_down);
+    prof_phase(PROF_ICONS);
+    for(int i=0;i<n;i++)
+        if(key_is_down(&keys[i],pressed[i])) draw_key_icon_text(&keys[i]);
+    prof_phase(PROF_LABELS);
+    text_batch_flush(win_w,win_h);
+}
+
+
+/* Damage tracking. Changes that only affect a few keys add rectangles
+   here instead of forcing a full redraw. With EGL_EXT_buffer_age the
+   frame repaints (under glScissor) the bounding box of this frame's damage
+   plus what the back buffer missed since it was last shown, and the
+   exact rectangles are handed to the compositor through
+   swap_buffers_with_damage. Anything unknown falls back to a full frame. */
+typedef struct { int x,y,w,h; } DmgRect; // window coords, y down
+#define DAMAGE_MAX 32
+#define DAMAGE_HISTORY 4
+
+static DmgRect damage_rects[DAMAGE_MAX];
+static int damage_n=0;
+static bool damage_overflow=false;
+static DmgRect damage_hist[DAMAGE_HISTORY]; // damage of previous frames, newest first
+static int damage_hist_n=0;
+
+static bool egl_buffer_age=false;
+static PFNEGLSETDAMAGEREGIONKHRPROC egl_set_damage_region=NULL;
+static PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC egl_swap_with_damage=NULL;
+
+static bool egl_has_ext(EGLDisplay edpy,const char* name){
+    const char* exts=eglQueryString(edpy,EGL_EXTENSIONS);
+    size_t len=strlen(name);
+    for(const char* p=exts; p && (p=strstr(p,name)); p+=len){
+        if((p==exts||p[-1]==' ') && (p[len]==' '||p[len]=='\0')) return true;
+    }
+    return false;
+}
+
+static void damage_init_egl(EGLDisplay edpy){
+    egl_buffer_age=egl_has_ext(edpy,"EGL_EXT_buffer_age")||egl_has_ext(edpy,"EGL_KHR_partial_update");
+    if(egl_has_ext(edpy,"EGL_KHR_partial_update"))
+        egl_set_damage_region=(PFNEGLSETDAMAGEREGIONKHRPROC)eglGetProcAddress("eglSetDamageRegionKHR");
+    if(egl_has_ext(edpy,"EGL_KHR_swap_buffers_with_damage"))
+        egl_swap_with_damage=(PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    else if(egl_has_ext(edpy,"EGL_EXT_swap_buffers_with_damage"))
+        egl_swap_with_damage=(PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+    printf("damage: buffer_age=%d partial_update=%d swap_with_damage=%d\n",
+           egl_buffer_age,egl_set_damage_region!=NULL,egl_swap_with_damage!=NULL);
+}
+
+static void damage_add(float x,float y,float w,float h){
+    if(damage_n==DAMAGE_MAX){ damage_overflow=true; return; }
+    int x0=(int)floorf(x), y0=(int)floorf(y);
+    int x1=(int)ceilf(x+w), y1=(int)ceilf(y+h);
+    damage_rects[damage_n++]=(DmgRect){x0,y0,x1-x0,y1-y0};
+}
+
+static void damage_key(const Key* K){ damage_add(K->x,K->y,K->w,K->h); }
+
+static bool damage_pending(void){ return damage_n>0||damage_overflow; }
+
+static DmgRect dmg_union(DmgRect a,DmgRect b){
+    if(a.w<=0||a.h<=0) return b;
+    if(b.w<=0||b.h<=0) return a;
+    int x0=a.x<b.x?a.x:b.x, y0=a.y<b.y?a.y:b.y;
+    int x1=(a.x+a.w>b.x+b.w)?a.x+a.w:b.x+b.w;
+    int y1=(a.y+a.h>b.y+b.h)?a.y+a.h:b.y+b.h;
+    return (DmgRect){x0,y0,x1-x0,y1-y0};
+}
+
+static DmgRect dmg_clip(DmgRect r,int win_w,int win_h){
+    int x0=r.x<0?0:r.x, y0=r.y<0?0:r.y;
+    int x1=r.x+r.w>win_w?win_w:r.x+r.w;
+    int y1=r.y+r.h>win_h?win_h:r.y+r.h;
+    if(x1<x0) x1=x0;
+    if(y1<y0) y1=y0;
+    return (DmgRect){x0,y0,x1-x0,y1-y0};
+}
+
+static DmgRect damage_bounds(int win_w,int win_h){
+    DmgRect b={0,0,0,0};
+    for(int i=0;i<damage_n;i++) b=dmg_union(b,damage_rects[i]);
+    return dmg_clip(b,win_w,win_h);
+}
+
+/* Decide the repaint area. Returns false for a full repaint. */
+static bool damage_begin_frame(EGLDisplay edpy,EGLSurface surf,int win_w,int win_h,
+                               bool full,DmgRect* box){
+    if(full||damage_overflow||!egl_buffer_age) return false;
+    EGLint age=0;
+    if(!eglQuerySurface(edpy,surf,EGL_BUFFER_AGE_EXT,&age)) return false;
+    if(age<=0||age-1>damage_hist_n) return false; // contents unknown
+
+    DmgRect b=damage_bounds(win_w,win_h);
+    for(int k=0;k<age-1;k++) b=dmg_union(b,damage_hist[k]);
+    b=dmg_clip(b,win_w,win_h);
+    if(b.w<=0||b.h<=0) return false;
+    *box=b;
+
+    if(egl_set_damage_region){
+        EGLint r[4]={b.x,win_h-b.y-b.h,b.w,b.h}; // EGL rects are bottom-left based
+        egl_set_damage_region(edpy,surf,r,1);
+    }
+    return true;
 }
 
+/* Present the frame and remember its damage for later buffer ages */
+static void damage_swap(EGLDisplay edpy,EGLSurface surf,int win_w,int win_h,bool partial){
+    DmgRect frame=partial?damage_bounds(win_w,win_h):(DmgRect){0,0,win_w,win_h};
+
+    if(partial&&egl_swap_with_damage){
+        EGLint r[DAMAGE_MAX*4]; int n=0;
+        for(int i=0;i<damage_n;i++){
+            DmgRect d=dmg_clip(damage_rects[i],win_w,win_h);
+            if(d.w<=0||d.h<=0) continue;
+            r[n*4+0]=d.x; r[n*4+1]=win_h-d.y-d.h; r[n*4+2]=d.w; r[n*4+3]=d.h;
+            n++;
+        }
+        egl_swap_with_damage(edpy,surf,r,n);
+    } else {
+        eglSwapBuffers(edpy,surf);
+    }
+
+    memmove(&damage_hist[1],&damage_hist[0],(DAMAGE_HISTORY-1)*sizeof(DmgRect));
+    damage_hist[0]=frame;
+    if(damage_hist_n<DAMAGE_HISTORY) damage_hist_n++;
+    damage_n=0;
+    damage_overflow=false;
+}
 
 
 /* ==================== MAIN ==================== */
+/* Layout hot reload: a thread watches the layout's directory (editors
+   usually save by rename), loads the new file off the main thread and
+   hands the finished Layout over through an atomic pointer and a loop
+   wakeup. A file that fails to load leaves the current layout in place. */
+static _Atomic(Layout*) reload_ready=NULL;
+static struct { char path[512], dir[512], name[256]; int fd, win_w, win_h; } reload_watch;
+
+static void* reload_main(void* arg){
+    (void)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;){
+        ssize_t n=read(reload_watch.fd,buf,sizeof(buf));
+        if(n<=0){ if(n<0&&errno==EINTR) continue; return NULL; }
+        bool hit=false;
+        for(char* p=buf;p<buf+n;){
+            struct inotify_event* e=(struct inotify_event*)p;
+            if(e->len&&strcmp(e->name,reload_watch.name)==0) hit=true;
+            p+=sizeof(*e)+e->len;
+        }
+        if(!hit) continue;
+        long t0=now_ms();
+        Layout* L=malloc(sizeof(Layout));
+        if(!L) continue;
+        if(load_layout_json(reload_watch.path,L,reload_watch.win_w,reload_watch.win_h)<=0){
+            fprintf(stderr,"reload: %s did not load, keeping the current layout\n",reload_watch.path);
+            free(L); continue;
+        }
+        printf("reload: %d keys from %s in %ld ms\n",L->nkeys,reload_watch.path,now_ms()-t0);
+        Layout* stale=atomic_exchange(&reload_ready,L); // main loop never saw it
+        if(stale){ layout_free(stale); free(stale); }
+        loop_wake();
+    }
+}
+
+static void reload_init(const char* path,int win_w,int win_h){
+    char tmp[512];
+    snprintf(reload_watch.path,sizeof(reload_watch.path),"%s",path);
+    snprintf(tmp,sizeof(tmp),"%s",path);
+    snprintf(reload_watch.dir,sizeof(reload_watch.dir),"%s",dirname(tmp));
+    snprintf(tmp,sizeof(tmp),"%s",path);
+    snprintf(reload_watch.name,sizeof(reload_watch.name),"%s",basename(tmp));
+    reload_watch.win_w=win_w; reload_watch.win_h=win_h;
+    reload_watch.fd=inotify_init1(IN_CLOEXEC);
+    pthread_t th;
+    if(reload_watch.fd<0||inotify_add_watch(reload_watch.fd,reload_watch.dir,IN_CLOSE_WRITE|IN_MOVED_TO)<0||
+       pthread_create(&th,NULL,reload_main,NULL)!=0){
+        fprintf(stderr,"Layout hot reload unavailable for %s\n",path);
+        if(reload_watch.fd>=0) close(reload_watch.fd);
+        reload_watch.fd=-1;
+        return;
+    }
+    pthread_detach(th);
+}
+
+/* Swap in a reloaded layout on the main thread. Modifier and layer
+   latches carry over; held keys are released (their XTest press/release already went
+   out, so this only drops repeats, touches and the menu). The arena holds
+   no pointers the injector or keymap keep, so the old one goes at once. */
+static void layout_swap(Display* dpy,Layout* cur,Layout* fresh,int win_w,int win_h){
+    repeat_clear();
+    touch_reset();
+    menu_visible=false; menu_pressed=-1;
+    layout_free(cur);
+    if(layer_active>=fresh->nlayers){ layer_active=0; layer_locked=false; }
+    *cur=*fresh;
+    layout_activate(cur);
+    Key* keys=cur->keys;
+    for(int i=0;i<cur->nkeys;i++){
+        KeySym ks=keys[i].keysym;
+        if(ks==XK_Shift_L||ks==XK_Shift_R) cur->pressed[i]=shift_down;
+        else if(ks==XK_Control_L||ks==XK_Control_R) cur->pressed[i]=ctrl_down;
+        else if(ks==XK_Alt_L||ks==XK_Alt_R) cur->pressed[i]=alt_down;
+        else cur->pressed[i]=0;
+    }
+    key_geom_build(keys,cur->nkeys,cur->nlayers);
+    hit_grid_build(&hit_grid,keys,cur->nkeys,win_w,win_h);
+    keymap_build(dpy,keys,cur->nkeys,cur->nlayers);
+    key_layers_invalidate();
+}
+
 int main(int argc,char**argv){
 
     Window last_focus = None;
     setbuf(stdout,NULL);
+    if(argc>=2 && strcmp(argv[1],"--bench-hittest")==0){ bench_hittest(); return 0; }
     const char* layout_path=(argc>=2)?argv[1]:"layout.json";
 
+    // The reload thread resolves keysym names (XStringToKeysym) while the
+    // main thread uses Xlib; XInitThreads makes Xlib's global state locked
+    XInitThreads();
     Display* dpy=XOpenDisplay(NULL);
     if(!dpy){fprintf(stderr,"XOpenDisplay failed\n");return 1;}
     int screen=DefaultScreen(dpy);
@@ -825,6 +3054,11 @@ XSelectInput(dpy, input, ButtonPressMask | ButtonReleaseMask);
 // Map the InputOnly child so it becomes active
 XMapWindow(dpy, input);
 
+inject_init();
+
+if (!xi2_init(dpy, input))
+    fprintf(stderr, "XInput 2.2 unavailable; single-pointer input only\n");
+
 XRaiseWindow(dpy, input);
 /*
 
@@ -843,7 +3077,7 @@ XChangeProperty(dpy, input, strut_atom, cardinal, 32,
 
 */
 
-XSelectInput(dpy, RootWindow(dpy, screen), FocusChangeMask);
+focus_init(dpy, win, input, launcher);
 
     printf("keyboard win id: 0x%lx\n", (unsigned long)win);
 
@@ -862,18 +3096,44 @@ XSelectInput(dpy, RootWindow(dpy, screen), FocusChangeMask);
 
 
     eglMakeCurrent(edpy,surf,surf,ctx);
+    damage_init_egl(edpy);
 
     rect_prog=make_program(RECT_VS,RECT_FS);
     rect_aPos=glGetAttribLocation(rect_prog,"aPos");
     rect_aCol=glGetAttribLocation(rect_prog,"aCol");
     rect_uRes=glGetUniformLocation(rect_prog,"uRes");
 
-    text_prog=make_program(TEXT_VS,TEXT_FS);
+    key_prog=make_program(KEY_VS,KEY_FS);
+    key_aPos=glGetAttribLocation(key_prog,"aPos");
+    key_aCol=glGetAttribLocation(key_prog,"aCol");
+    key_aLocal=glGetAttribLocation(key_prog,"aLocal");
+    key_aShape=glGetAttribLocation(key_prog,"aShape");
+    key_uRes=glGetUniformLocation(key_prog,"uRes");
+
+    // Distance-field text needs fwidth(); otherwise stay on the baked bitmap
+    font_sdf=gl_has_ext("GL_OES_standard_derivatives");
+    init_font();
+    printf("font: %s atlas\n", font_sdf ? "SDF" : "bitmap");
+
+    text_prog=make_program(TEXT_VS,font_sdf?TEXT_FS_SDF:TEXT_FS);
     text_aPos=glGetAttribLocation(text_prog,"aPos");
     text_aUV=glGetAttribLocation(text_prog,"aUV");
     text_uRes=glGetUniformLocation(text_prog,"uRes");
     text_uFont=glGetUniformLocation(text_prog,"uFont");
-    text_uColor = glGetUniformLocation(text_prog,"uColor");
+    text_aCol=glGetAttribLocation(text_prog,"aCol");
+
+    blit_prog=make_program(BLIT_VS,BLIT_FS);
+    blit_aPos=glGetAttribLocation(blit_prog,"aPos");
+    blit_aUV=glGetAttribLocation(blit_prog,"aUV");
+    blit_uTex=glGetUniformLocation(blit_prog,"uTex");
+
+    prof_gpu_init(gl_has_ext("GL_EXT_disjoint_timer_query"));
+    loop_init();
+    signal(SIGUSR1,prof_on_sigusr1);
+    signal(SIGINT,on_terminate);
+    signal(SIGTERM,on_terminate);
+    atexit(prof_dump);
+    atexit(lat_dump);
 
     glViewport(0,0,win_w,win_h);
     glClearColor(0.1f,0.1f,0.12f,1.0f);
@@ -881,15 +3141,20 @@ XSelectInput(dpy, RootWindow(dpy, screen), FocusChangeMask);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
 
-    init_font();
-
-    Key keys[256];
-    int nkeys=load_layout_json(layout_path,keys,256,win_w,win_h);
+    Layout layout;
+    int nkeys=load_layout_json(layout_path,&layout,win_w,win_h);
+    layout_activate(&layout);
+    Key* keys=layout.keys;
     printf("Loaded %d keys from %s\n",nkeys,layout_path);
+    key_geom_build(keys,nkeys,layout.nlayers);
+    hit_grid_build(&hit_grid,keys,nkeys,win_w,win_h);
+    keymap_init(dpy);
+    keymap_build(dpy,keys,nkeys,layout.nlayers);
+    clip_init(dpy,win);
+    key_layers_invalidate();
+    reload_init(layout_path,win_w,win_h);
 
-    int pressed[256]={0};
-    struct timespec press_time[256];
-    long last_repeat[256]={0};
+    unsigned char* pressed=layout.pressed;
 
     bool dirty = true;
 
@@ -905,34 +3170,25 @@ XSelectInput(dpy, RootWindow(dpy, screen), FocusChangeMask);
 
     /* Capture target once at startup: use pointer location, deepest child.
        If focus already points to a valid external client, prefer that. */
-    Window root = DefaultRootWindow(dpy), child;
-    int rx, ry, wx, wy; unsigned int mask;
-    XWindowAttributes attr;
-    Window fw; int revert;
-    XGetInputFocus(dpy, &fw, &revert);
-
-    if (fw != None &&
-        fw != win &&
-        fw != input &&
-        fw != root &&
-        fw != (Window)0x1) {
+    // Focus and pointer requests go out together; usually only one is needed
+    xcb_connection_t* xc = XGetXCBConnection(dpy);
+    xcb_get_input_focus_cookie_t fc = xcb_get_input_focus(xc);
+    xcb_query_pointer_cookie_t pc = xcb_query_pointer(xc, DefaultRootWindow(dpy));
+    xcb_get_input_focus_reply_t* fr = xcb_get_input_focus_reply(xc, fc, NULL);
+    xcb_query_pointer_reply_t* pr = xcb_query_pointer_reply(xc, pc, NULL);
+    Window fw = fr ? fr->focus : None, child = pr ? pr->child : None;
+    free(fr); free(pr);
+
+    if (focus_usable(dpy, fw)) {
         last_focus = fw;
-    } else if (XQueryPointer(dpy, root, &root, &child, &rx, &ry, &wx, &wy, &mask) && child != None) {
-        Window target = deepest_under_pointer(dpy, child);
-        last_focus = find_input_child(dpy, target);
-
-        if (last_focus != None && XGetWindowAttributes(dpy, last_focus, &attr)) {
-            XSetInputFocus(dpy, last_focus, RevertToParent, CurrentTime);
-        } else {
-            last_focus = None; // reset
-        }
-
+    } else if (child != None) {
+        last_focus = input_target_under_pointer(dpy, child);
     }
 
     if (last_focus != None) {
         print_window_info(dpy, last_focus, "Captured target");
         // Give it focus once, then never reassert
-        if (last_focus != None && XGetWindowAttributes(dpy, last_focus, &attr)) {
+        if (window_alive(dpy, last_focus)) {
             XSetInputFocus(dpy, last_focus, RevertToParent, CurrentTime);
         } else {
             last_focus = None; // reset
@@ -944,50 +3200,25 @@ XSelectInput(dpy, RootWindow(dpy, screen), FocusChangeMask);
     }
 
     for(;;){
-
-if (keyboard_visible) {
-
-    Window root = DefaultRootWindow(dpy), child;
-    int rx, ry, wx, wy; unsigned int mask;
-    XWindowAttributes attr;
-    Window fw; int revert;
-    XGetInputFocus(dpy, &fw, &revert);
-
-    if (fw != None &&
-        fw != win &&
-        fw != input &&
-        fw != root &&
-        fw != (Window)0x1) {
-        last_focus = fw;
-    }
-
-    if (XQueryPointer(dpy, root, &root, &child, &rx, &ry, &wx, &wy, &mask) && child != None) {
-
-    if (child != None &&
-        child != win &&
-        child != input &&
-        child != root &&
-        child != (Window)0x1) {
-
-        Window target = deepest_under_pointer(dpy, child);
-        last_focus = find_input_child(dpy, target);
-
-        if (last_focus != None) {
-
-	if (XGetWindowAttributes(dpy, last_focus, &attr)) {
-            XSetInputFocus(dpy, last_focus, RevertToParent, CurrentTime);
-        } else {
-            last_focus = None; // reset
+        if (quit_requested) exit(0);
+        if (prof_dump_requested) { prof_dump_requested=0; prof_dump(); lat_dump(); }
+
+        Layout* fresh = atomic_exchange(&reload_ready, NULL);
+        if (fresh) {
+            layout_swap(dpy, &layout, fresh, win_w, win_h);
+            free(fresh);
+            keys = layer_keys(&layout, layer_active); pressed = layout.pressed; nkeys = layout.nkeys;
+            dirty = true;
         }
 
-	}
-	}
-    }
-
-}
-
         while(XPending(dpy)){
             XEvent ev; XNextEvent(dpy,&ev);
+            if (focus_handle_event(dpy, &ev, &last_focus, keyboard_visible)) continue;
+            if (keymap_handle_event(dpy, &ev)) continue;
+            if (clip_handle_event(dpy, &ev)) continue;
+
+            int px = 0, py = 0; long touch; Time ptr_time = 0;
+            int ptr = pointer_event(dpy, &ev, input, &px, &py, &touch, &ptr_time);
 
 if (ev.type == Expose && ev.xany.window == input || ev.xany.window == win) {
 dirty=true;
@@ -1013,9 +3244,11 @@ float scale = 1.0f;
 float tw = text_width("⌨", scale);
 float tx = (40 - tw)/2.0f;
 float ty = 25; // vertical center
-draw_text_colored("⌨", tx, ty, scale, 40, 40, 0.12f,0.12f,0.12f); // dark dark grey
+draw_text_colored("⌨", tx, ty, scale, 0.12f,0.12f,0.12f); // dark dark grey
+text_batch_flush(40, 40);
 
 eglSwapBuffers(edpy, launcher_surf);
+frame_draw_calls = 0;
 
 
 
@@ -1024,6 +3257,7 @@ eglSwapBuffers(edpy, launcher_surf);
             XMapWindow(dpy, win);     // show
             XUnmapWindow(dpy, launcher);
             keyboard_visible = true;
+            focus_sync(dpy, &last_focus);
         }
     }
 
@@ -1043,7 +3277,7 @@ eglSwapBuffers(edpy, launcher_surf);
 
 
 
-            if (ev.type == ButtonPress && ev.xany.window == input){
+            if (ptr == PTR_PRESS){
 
 
 // --- Handle menu clicks first ---
@@ -1056,9 +3290,9 @@ if (menu_visible) {
     float y = prefKey.y - menu_h - 2;
 
     // Click inside menu: press that entry (darken)
-    if (ev.xbutton.x >= x && ev.xbutton.x < x+menu_w &&
-        ev.xbutton.y >= y && ev.xbutton.y < y+menu_h) {
-        int idx = (ev.xbutton.y - y) / prefKey.h;
+    if (px >= x && px < x+menu_w &&
+        py >= y && py < y+menu_h) {
+        int idx = (py - y) / prefKey.h;
         if (idx >= 0 && idx < pref_menu_count) {
             menu_pressed = idx;
             dirty = true;
@@ -1075,14 +3309,14 @@ if (menu_visible) {
 }
 
 
-                for (int i = 0; i < nkeys; i++) {
-                    if (ev.xbutton.x >= keys[i].x && ev.xbutton.x < keys[i].x + keys[i].w &&
-                        ev.xbutton.y >= keys[i].y && ev.xbutton.y < keys[i].y + keys[i].h) {
+                int i = hit_test(&hit_grid, keys, px, py);
+                {
+                    if (i >= 0) {
                         pressed[i] = 1;
-                        clock_gettime(CLOCK_MONOTONIC, &press_time[i]);
-                        last_repeat[i] = 0;
+                        touch_bind(touch, i);
+                        int trace = lat_begin(ptr_time);
 
-		        dirty = true;
+		        damage_key(&keys[i]);
 
 
             // --- Preferences key toggle ---
@@ -1109,87 +3343,69 @@ if (menu_visible) {
                         if (keys[i].keysym == XK_Control_L || keys[i].keysym == XK_Control_R) {
                             ctrl_down = !ctrl_down;
                             pressed[i] = ctrl_down;
-                dirty = true;
                             goto handled_press;
                         }
                         if (keys[i].keysym == XK_Alt_L || keys[i].keysym == XK_Alt_R) {
                             alt_down = !alt_down;
                             pressed[i] = alt_down;
-                dirty = true;
                             goto handled_press;
                         }
 
-			if (keys[i].keysym == XK_Mode_switch) {  // Fn key
-			    fn_down = !fn_down;          // activate Fn
+			if (keys[i].layer || keys[i].keysym == XK_Mode_switch) {  // layer key (Fn, symbols, ...)
+			    bool on = keys[i].layer && layer_active != keys[i].layer;
+			    layer_active = on ? keys[i].layer : 0;
+			    layer_locked = on && keys[i].layer_lock;
 			    pressed[i] = 1;       // show it pressed
                 dirty = true;
 			    goto handled_press;
 			}
 
 
-                            KeySym base = keys[i].keysym;
-
-
-    // --- Fn remapping: if fn_down is active, remap number row to F1–F12 ---
-    if (fn_down) {
-        switch (base) {
-            case XK_1:     base = XK_F1;  break;
-            case XK_2:     base = XK_F2;  break;
-            case XK_3:     base = XK_F3;  break;
-            case XK_4:     base = XK_F4;  break;
-            case XK_5:     base = XK_F5;  break;
-            case XK_6:     base = XK_F6;  break;
-            case XK_7:     base = XK_F7;  break;
-            case XK_8:     base = XK_F8;  break;
-            case XK_9:     base = XK_F9;  break;
-            case XK_0:     base = XK_F10; break;
-            case XK_minus: base = XK_F11; break;
-            case XK_equal: base = XK_F12; break;
-        }
-        fn_down = 0;   // auto-release after one use
-
-        // clear Fn pressed state so the button visually resets
-//        for (int j=0; j<nkeys; j++) {
-//            if (keys[j].keysym == XK_Mode_switch) {
-//                pressed[j] = 0;
-//                break;
-//           }
-	    dirty = true;
-
-//        }
+    // --- Layers: keys[] already holds this layer's overrides; a one-shot
+    //     layer (Fn) is dropped after this key ---
+    int layer_used = layer_active;
+    if (layer_active && !layer_locked) {
+        layer_active = 0;   // auto-release after one use
+        dirty = true;
     }
                         // --- Normal key injection (no focus change) ---
-                        if (last_focus != None) {
+                        if (last_focus != None && keys[i].text) {
+                            text_send(dpy, i, layer_used, trace);
+                        }
+                        else if (last_focus != None) {
 
-                            KeyCode kc  = XKeysymToKeycode(dpy, base);
-                            KeyCode skc = XKeysymToKeycode(dpy, XK_Shift_L);
-                            KeyCode ckc = XKeysymToKeycode(dpy, XK_Control_L);
-                            KeyCode akc = XKeysymToKeycode(dpy, XK_Alt_L);
+                            KeyCode kc  = key_keycode(dpy, i, layer_used);
+                            KeyCode skc = mod_keycode(dpy, XK_Shift_L);
+                            KeyCode ckc = mod_keycode(dpy, XK_Control_L);
+                            KeyCode akc = mod_keycode(dpy, XK_Alt_L);
 
                             int need_shift = 0;
-                            if (strlen(keys[i].label) == 1 && isalpha((unsigned char)keys[i].label[0])) {
+                            if (strlen(key_str(keys[i].label)) == 1 && isalpha((unsigned char)key_str(keys[i].label)[0])) {
                                 if (caps_down ^ shift_down) need_shift = 1;
                             } else {
                                 if (shift_down) need_shift = 1;
                             }
 
                             // Press modifiers if needed
-                            if (need_shift && skc) XTestFakeKeyEvent(dpy, skc, True, 0);
-                            if (ctrl_down && ckc)  XTestFakeKeyEvent(dpy, ckc, True, 0);
-                            if (alt_down && akc)   XTestFakeKeyEvent(dpy, akc, True, 0);
+                            if (need_shift && skc) inject_key(dpy, skc, true);
+                            if (ctrl_down && ckc)  inject_key(dpy, ckc, true);
+                            if (alt_down && akc)   inject_key(dpy, akc, true);
 
                             // Actual key
                             if (kc) {
-                                XTestFakeKeyEvent(dpy, kc, True, 0);
-                                XTestFakeKeyEvent(dpy, kc, False, 0);
+                                inject_key(dpy, kc, true);
+                                inject_key(dpy, kc, false);
                             }
 
                             // Release modifiers if auto-release
-                            if (alt_down && akc)   XTestFakeKeyEvent(dpy, akc, False, 0);
-                            if (ctrl_down && ckc)  XTestFakeKeyEvent(dpy, ckc, False, 0);
-                            if (need_shift && skc) XTestFakeKeyEvent(dpy, skc, False, 0);
+                            if (alt_down && akc)   inject_key(dpy, akc, false);
+                            if (ctrl_down && ckc)  inject_key(dpy, ckc, false);
+                            if (need_shift && skc) inject_key(dpy, skc, false);
+
+                            inject_commit(dpy, trace);
 
-                            XFlush(dpy);
+                            repeat_start(&keys[i], i, (need_shift ? REP_SHIFT : 0) | (ctrl_down ? REP_CTRL : 0) |
+                                                      (alt_down ? REP_ALT : 0), layer_used);
                         }
 
                         // --- Reset modifiers after non-modifier key ---
@@ -1197,22 +3413,28 @@ if (menu_visible) {
                             keys[i].keysym != XK_Control_L && keys[i].keysym != XK_Control_R &&
                             keys[i].keysym != XK_Alt_L && keys[i].keysym != XK_Alt_R &&
                             keys[i].keysym != XK_Caps_Lock) {
+                            if (shift_down) dirty = true; // labels change
                             shift_down = 0; ctrl_down = 0; alt_down = 0;
                             for (int j = 0; j < nkeys; j++) {
-                                if (keys[j].keysym == XK_Shift_L || keys[j].keysym == XK_Shift_R) pressed[j] = 0;
-                                if (keys[j].keysym == XK_Control_L || keys[j].keysym == XK_Control_R) pressed[j] = 0;
-                                if (keys[j].keysym == XK_Alt_L || keys[j].keysym == XK_Alt_R) pressed[j] = 0;
+                                KeySym ks = keys[j].keysym;
+                                if (ks == XK_Shift_L || ks == XK_Shift_R ||
+                                    ks == XK_Control_L || ks == XK_Control_R ||
+                                    ks == XK_Alt_L || ks == XK_Alt_R) {
+                                    if (pressed[j]) damage_key(&keys[j]);
+                                    pressed[j] = 0;
+                                }
                             }
                         }
 
                         goto handled_press;
                     }
                 }
-                handled_press: ;
+                handled_press:
+                keys = layer_keys(&layout, layer_active);
             }
 
-            else if(ev.type==ButtonRelease){
-
+            else if(ptr == PTR_RELEASE){
+                int released = touch_take(touch);
 
 if (menu_visible) {
     Key prefKey = get_preferences_key(keys, nkeys);
@@ -1227,21 +3449,23 @@ if (menu_visible) {
         menu_pressed = -1;
 
         // Only trigger if release is still inside the pressed entry (like a key)
-        if (ev.xbutton.x >= x && ev.xbutton.x < x+menu_w &&
-            ev.xbutton.y >= y + idx*prefKey.h && ev.xbutton.y < y + (idx+1)*prefKey.h) {
-            if (strcmp(pref_menu[idx].action,"quit")==0) {
+        if (px >= x && px < x+menu_w &&
+            py >= y + idx*prefKey.h && py < y + (idx+1)*prefKey.h) {
+            if (strcmp(key_str(pref_menu[idx].action),"quit")==0) {
                 exit(0);
             } 
-else if (strcmp(pref_menu[idx].action,"hide")==0) {
+else if (strcmp(key_str(pref_menu[idx].action),"hide")==0) {
     // Release all pressed keys
     for (int i=0; i<nkeys; i++) {
         if (pressed[i]) {
-            KeyCode kc = XKeysymToKeycode(dpy, keys[i].keysym);
-            if (kc) XTestFakeKeyEvent(dpy, kc, False, 0);
+            KeyCode kc = key_keycode(dpy, i, 0);
+            if (kc) inject_key(dpy, kc, false);
             pressed[i] = 0;
         }
     }
-    XFlush(dpy);
+    touch_reset();
+    repeat_clear();
+    inject_commit(dpy, LAT_NONE);
 
     // Hide keyboard, show launcher
     XUnmapWindow(dpy, win);
@@ -1260,486 +3484,57 @@ else if (strcmp(pref_menu[idx].action,"hide")==0) {
 
 
 
-                for(int i=0;i<nkeys;i++){
-                    if(pressed[i]){
-                        if(keys[i].keysym==XK_Caps_Lock){
-                            pressed[i]=0;
-                        }
-                        else if(keys[i].keysym==XK_Shift_L||keys[i].keysym==XK_Shift_R){
-                            pressed[i]=shift_down;
-                        }
-                        else if(keys[i].keysym==XK_Control_L||keys[i].keysym==XK_Control_R){
-                            pressed[i]=ctrl_down;
-                        }
-                        else if(keys[i].keysym==XK_Alt_L||keys[i].keysym==XK_Alt_R){
-                            pressed[i]=alt_down;
-                        }
-                        else pressed[i]=0;
-                        last_repeat[i]=0;
-
-			dirty = true;
-
-                        break;
+                // Release the key this touch/pointer went down on
+                int i = released;
+                if(i>=0 && i<nkeys && pressed[i]){
+                    if(keys[i].keysym==XK_Caps_Lock){
+                        pressed[i]=0;
                     }
-                }
-
-            }
-        }
-
-        long now = now_ms();
-        for (int i = 0; i < nkeys; i++) {
-            if (pressed[i]) {
-                long t0 = press_time[i].tv_sec*1000 + press_time[i].tv_nsec/1000000;
-                long dt = now - t0;
-
-                // Start repeating after 400ms, then every 100ms
-                if (dt > 400 && (last_repeat[i] == 0 || now - last_repeat[i] > 100)) {
-                    if (last_focus != None) {
-                        KeySym base = keys[i].keysym;
-                        KeyCode kc  = XKeysymToKeycode(dpy, base);
-                        KeyCode skc = XKeysymToKeycode(dpy, XK_Shift_L);
-
-                        int need_shift = 0;
-                        if (strlen(keys[i].label) == 1 && isalpha((unsigned char)keys[i].label[0])) {
-                            if (caps_down ^ shift_down) need_shift = 1;
-                        } else {
-                            if (shift_down) need_shift = 1;
-                        }
-
-                        // Press modifiers if needed
-                        if (need_shift && skc) XTestFakeKeyEvent(dpy, skc, True, 0);
-
-                        // Actual key
-                        if (kc) {
-                            XTestFakeKeyEvent(dpy, kc, True, 0);
-                            XTestFakeKeyEvent(dpy, kc, False, 0);
-                        }
-
-                        // Release modifiers
-                        if (need_shift && skc) XTestFakeKeyEvent(dpy, skc, False, 0);
-
-                        XFlush(dpy);
+                    else if(keys[i].keysym==XK_Shift_L||keys[i].keysym==XK_Shift_R){
+                        pressed[i]=shift_down;
                     }
-                    last_repeat[i] = now;
-
-		    dirty = true;
+                    else if(keys[i].keysym==XK_Control_L||keys[i].keysym==XK_Control_R){
+                        pressed[i]=ctrl_down;
+                    }
+                    else if(keys[i].keysym==XK_Alt_L||keys[i].keysym==XK_Alt_R){
+                        pressed[i]=alt_down;
+                    }
+                    else pressed[i]=0;
+                    repeat_cancel(i);
 
+                    damage_key(&keys[i]);
                 }
+
             }
         }
 
-if (dirty) {
-    glClear(GL_COLOR_BUFFER_BIT);
-
-draw_keys(win_w, win_h, keys, nkeys, pressed, caps_down);
-
-for (int i=0; i<nkeys; i++) {
-    draw_key_labels(&keys[i], win_w, win_h, shift_down, caps_down);
-}
-
-
-/*
-        float scale=fmaxf(0.6f,(keys[i].h*0.6f)/32.0f);
-        float w=text_width(s,scale);
-        float x=keys[i].x+(keys[i].w-w)/2.0f;
-        float y=keys[i].y+keys[i].h*0.6f;
-        draw_text(s,x,y,scale,win_w,win_h);
-*/
-
-
-for (int i = 0; i < nkeys; i++) {
-    // Special-case: draw Windows-style backspace icon
-
-// UP chevron
-if (keys[i].keysym == XK_Up) {
-    float x = keys[i].x, y = keys[i].y;
-    float cx = x + 18.0f;   // top-left anchor
-    float cy = y + 10.0f;
-
-    float wsize = 13.0f;   // wider horizontal half-span
-    float hsize = 5.0f;    // shallow vertical height
-    float s = 2.0f;        // stroke thickness
-
-    float r=1,g=1,b=1; if (pressed[i]) r=g=b=0.75f;
-    typedef struct { float x,y,r,g,b; } V;
-
-float tipX = cx;
-float tipY = cy - hsize;
-
-    glUseProgram(rect_prog);
-    glUniform2f(rect_uRes,(float)win_w,(float)win_h);
-
-    // Left arm: bottom-left to tip
-V left[6] = {
-    {cx-wsize, cy+hsize, r,g,b},
-    {cx-wsize+s, cy+hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {cx-wsize, cy+hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {tipX-s, tipY, r,g,b}   // overlap at tip
-};
-
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&left[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&left[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-V right[6] = {
-    {cx+wsize, cy+hsize, r,g,b},
-    {cx+wsize-s, cy+hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {cx+wsize, cy+hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {tipX+s, tipY, r,g,b}   // overlap at tip
-};
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&right[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&right[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    continue;
-}
-
-if (keys[i].keysym == XK_Down) {
-    float x = keys[i].x, y = keys[i].y;
-    float cx = x + 18.0f;   // top-left anchor
-    float cy = y + 16.0f;
-
-    float wsize = 13.0f;
-    float hsize = 5.0f;
-    float s = 2.0f;
-
-    float r=1,g=1,b=1; if (pressed[i]) r=g=b=0.75f;
-    typedef struct { float x,y,r,g,b; } V;
-
-float tipX = cx;
-float tipY = cy + hsize;
-
-    glUseProgram(rect_prog);
-    glUniform2f(rect_uRes,(float)win_w,(float)win_h);
-
-    // Left arm: top-left to tip
-
-V left[6] = {
-    {cx-wsize, cy-hsize, r,g,b},
-    {cx-wsize+s, cy-hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {cx-wsize, cy-hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {tipX-s, tipY, r,g,b}
-};
-
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&left[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&left[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    // Right arm: top-right to tip
-
-V right[6] = {
-    {cx+wsize, cy-hsize, r,g,b},
-    {cx+wsize-s, cy-hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {cx+wsize, cy-hsize, r,g,b},
-    {tipX, tipY, r,g,b},
-    {tipX+s, tipY, r,g,b}
-};
-
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&right[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&right[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    continue;
-}
-
-if (keys[i].keysym == XK_Left) {
-    float x = keys[i].x, y = keys[i].y;
-    float cx = x + 18.0f;
-    float cy = y + 12.0f;
-
-    float wsize = 2.0f;   // shallow horizontal
-    float hsize = 10.0f;  // tall vertical span
-    float s = 2.0f;
-
-    float r=1,g=1,b=1; if (pressed[i]) r=g=b=0.75f;
-    typedef struct { float x,y,r,g,b; } V;
-
-    glUseProgram(rect_prog);
-    glUniform2f(rect_uRes,(float)win_w,(float)win_h);
-
-    // Upper arm: top-right to tip
-    V upper[6] = {
-        {cx+wsize, cy-hsize, r,g,b},
-        {cx+wsize, cy-hsize+s, r,g,b},
-        {cx-hsize, cy, r,g,b},
-        {cx+wsize, cy-hsize, r,g,b},
-        {cx-hsize, cy, r,g,b},
-        {cx-hsize, cy-s, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&upper[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&upper[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    // Lower arm: bottom-right to tip
-    V lower[6] = {
-        {cx+wsize, cy+hsize, r,g,b},
-        {cx+wsize, cy+hsize-s, r,g,b},
-        {cx-hsize, cy, r,g,b},
-        {cx+wsize, cy+hsize, r,g,b},
-        {cx-hsize, cy, r,g,b},
-        {cx-hsize, cy+s, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&lower[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&lower[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    continue;
-}
-
-if (keys[i].keysym == XK_Right) {
-    float x = keys[i].x, y = keys[i].y;
-    float cx = x + 12.0f;
-    float cy = y + 12.0f;
-
-    float wsize = 2.0f;
-    float hsize = 10.0f;
-    float s = 2.0f;
-
-    float r=1,g=1,b=1; if (pressed[i]) r=g=b=0.75f;
-    typedef struct { float x,y,r,g,b; } V;
-
-    glUseProgram(rect_prog);
-    glUniform2f(rect_uRes,(float)win_w,(float)win_h);
-
-    // Upper arm: top-left to tip
-    V upper[6] = {
-        {cx-wsize, cy-hsize, r,g,b},
-        {cx-wsize, cy-hsize+s, r,g,b},
-        {cx+hsize, cy, r,g,b},
-        {cx-wsize, cy-hsize, r,g,b},
-        {cx+hsize, cy, r,g,b},
-        {cx+hsize, cy-s, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&upper[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&upper[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    // Lower arm: bottom-left to tip
-    V lower[6] = {
-        {cx-wsize, cy+hsize, r,g,b},
-        {cx-wsize, cy+hsize-s, r,g,b},
-        {cx+hsize, cy, r,g,b},
-        {cx-wsize, cy+hsize, r,g,b},
-        {cx+hsize, cy, r,g,b},
-        {cx+hsize, cy+s, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&lower[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&lower[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    continue;
-}
-
-
-
-if (keys[i].keysym == XK_Preferences) {
-
-    float x = keys[i].x, y = keys[i].y, w = keys[i].w, h = keys[i].h;
-
-    // Position top-left with padding
-    float cx = x + 14.0f;
-    float cy = y + 14.0f;
-    float outer_r = h * 0.18f;   // outer radius
-    float inner_r = h * 0.10f;   // inner hole radius
-    int teeth = 8;
-    float stroke = 2.0f;         // outline thickness
-
-    float r=0.0f,g=0.0f,b=0.0f;  // black outline
-    if (pressed[i]) { r=g=b=0.3f; } // dark grey when pressed
-
-    typedef struct { float x,y,r,g,b; } V;
-    glUseProgram(rect_prog);
-    glUniform2f(rect_uRes,(float)win_w,(float)win_h);
-
-    // Teeth outlines
-    for(int t=0;t<teeth;t++){
-        float a = 2*M_PI*t/teeth;
-        float tx0 = cx+(outer_r-stroke)*cosf(a);
-        float ty0 = cy+(outer_r-stroke)*sinf(a);
-        float tx1 = cx+(outer_r+stroke*2)*cosf(a);
-        float ty1 = cy+(outer_r+stroke*2)*sinf(a);
-        float w2 = stroke;
-        V tooth[6] = {
-            {tx0-w2*sinf(a),ty0+w2*cosf(a),r,g,b},
-            {tx1-w2*sinf(a),ty1+w2*cosf(a),r,g,b},
-            {tx1+w2*sinf(a),ty1-w2*cosf(a),r,g,b},
-            {tx0-w2*sinf(a),ty0+w2*cosf(a),r,g,b},
-            {tx1+w2*sinf(a),ty1-w2*cosf(a),r,g,b},
-            {tx0+w2*sinf(a),ty0-w2*cosf(a),r,g,b}
-        };
-        glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&tooth[0].x);
-        glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&tooth[0].r);
-        glDrawArrays(GL_TRIANGLES,0,6);
-    }
-
-    // Outer ring outline (approximate circle with quads)
-    int n=24;
-    for(int k=0;k<n;k++){
-        float a0 = 2*M_PI*k/n;
-        float a1 = 2*M_PI*(k+1)/n;
-        V ring[6] = {
-            {cx+(outer_r-stroke)*cosf(a0), cy+(outer_r-stroke)*sinf(a0), r,g,b},
-            {cx+(outer_r+stroke)*cosf(a0), cy+(outer_r+stroke)*sinf(a0), r,g,b},
-            {cx+(outer_r+stroke)*cosf(a1), cy+(outer_r+stroke)*sinf(a1), r,g,b},
-            {cx+(outer_r-stroke)*cosf(a0), cy+(outer_r-stroke)*sinf(a0), r,g,b},
-            {cx+(outer_r+stroke)*cosf(a1), cy+(outer_r+stroke)*sinf(a1), r,g,b},
-            {cx+(outer_r-stroke)*cosf(a1), cy+(outer_r-stroke)*sinf(a1), r,g,b}
-        };
-        glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&ring[0].x);
-        glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&ring[0].r);
-        glDrawArrays(GL_TRIANGLES,0,6);
-    }
-
-    // Inner hole (draw in key background color to punch it out)
-    int m=24;
-    for(int k=0;k<m;k++){
-        float a0 = 2*M_PI*k/m;
-        float a1 = 2*M_PI*(k+1)/m;
-        V hole[3] = {
-            {cx,cy, 0.2f,0.2f,0.2f}, // background color
-            {cx+inner_r*cosf(a0), cy+inner_r*sinf(a0), 0.2f,0.2f,0.2f},
-            {cx+inner_r*cosf(a1), cy+inner_r*sinf(a1), 0.2f,0.2f,0.2f}
-        };
-        glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&hole[0].x);
-        glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&hole[0].r);
-        glDrawArrays(GL_TRIANGLES,0,3);
-    }
-
-    continue;
-
-
-}
-
-
-if (keys[i].keysym == XK_BackSpace) {
-    float x = keys[i].x, y = keys[i].y, w = keys[i].w, h = keys[i].h;
-
-    // Fixed scale for X
-    float scale = fmaxf(0.6f,(h*0.5f)/32.0f);
-    float tw    = text_width("X", scale);
-    float th    = scale * 20.0f; // approx glyph height
-
-    // Box size:
-float pad   = 1.0f;
-float box_w = tw + pad*2;
-float box_h = th + pad*2 - 2.0f; // 2px shorter vertically
-
-    // Position top-left inside key
-    float cx = x + 10.0f;
-    float cy = y + 4.0f;
-
-    float s = 1.0f; // stroke thickness
-    float r=1.0f,g=1.0f,b=1.0f;
-    if (pressed[i]) { r = g = b = 0.75f; }
-
-    typedef struct { float x,y,r,g,b; } V;
-    glUseProgram(rect_prog);
-    glUniform2f(rect_uRes, (float)win_w, (float)win_h);
-
-    // Top stroke
-    V top[6] = {
-        {cx,cy, r,g,b},{cx+box_w,cy, r,g,b},{cx+box_w,cy+s, r,g,b},
-        {cx,cy, r,g,b},{cx+box_w,cy+s, r,g,b},{cx,cy+s, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&top[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&top[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    // Bottom stroke
-    V bottom[6] = {
-        {cx,cy+box_h-s, r,g,b},{cx+box_w,cy+box_h-s, r,g,b},{cx+box_w,cy+box_h, r,g,b},
-        {cx,cy+box_h-s, r,g,b},{cx+box_w,cy+box_h, r,g,b},{cx,cy+box_h, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&bottom[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&bottom[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    // Right stroke
-    V right[6] = {
-        {cx+box_w-s,cy, r,g,b},{cx+box_w,cy, r,g,b},{cx+box_w,cy+box_h, r,g,b},
-        {cx+box_w-s,cy, r,g,b},{cx+box_w,cy+box_h, r,g,b},{cx+box_w-s,cy+box_h, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&right[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&right[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    // Left chevron strokes — tip further left for steeper angle
-    float tip_x = cx - box_w * 0.6f;   // move tip further left
-    float tip_y = cy + box_h * 0.5f;
-
-    V chevr_up[6] = {
-        {tip_x,tip_y, r,g,b},{cx,cy, r,g,b},{cx,cy+s, r,g,b},
-        {tip_x,tip_y, r,g,b},{cx,cy+s, r,g,b},{tip_x+s,tip_y, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&chevr_up[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&chevr_up[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
+        long next_repeat = repeat_run(dpy, last_focus != None);
 
-    V chevr_dn[6] = {
-        {tip_x,tip_y, r,g,b},{cx,cy+box_h-s, r,g,b},{cx,cy+box_h, r,g,b},
-        {tip_x,tip_y, r,g,b},{cx,cy+box_h, r,g,b},{tip_x+s,tip_y, r,g,b}
-    };
-    glVertexAttribPointer(rect_aPos,2,GL_FLOAT,GL_FALSE,sizeof(V),&chevr_dn[0].x);
-    glVertexAttribPointer(rect_aCol,3,GL_FLOAT,GL_FALSE,sizeof(V),&chevr_dn[0].r);
-    glDrawArrays(GL_TRIANGLES,0,6);
-
-    // Draw "X" inside — lower baseline slightly
-    float tx = cx + pad - 0.01f;
-    float ty = cy + box_h*0.76f; // lowered baseline
-    draw_text("x", tx, ty, scale, win_w, win_h);
-
-    continue;
-}
-
-/*
-if (keys[i].keysym == XK_Mode_switch) {  // Fn key
-    fn_down = 1;          // activate Fn
-    pressed[i] = 1;       // show it pressed
-    goto handled_press;
-}
-*/
+if (dirty || damage_pending()) {
+    // Repaint only the damaged area when the back buffer's age is known
+    DmgRect box;
+    prof_frame_begin();
+    bool partial = damage_begin_frame(edpy, surf, win_w, win_h, dirty, &box);
 
-    // Compute the label string with your existing logic
-    const char* s = keys[i].label;
-    static char buf[64];
-    if (strlen(keys[i].label) == 1 && isalpha((unsigned char)keys[i].label[0])) {
-        strcpy(buf, keys[i].label);
-        buf[0] = (caps_down ^ shift_down) ? toupper(buf[0]) : tolower(buf[0]);
-        s = buf;
-    } else if (shift_down && keys[i].shift_label[0]) {
-        s = keys[i].shift_label;
+    glViewport(0,0,win_w,win_h);
+    if (partial) {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(box.x, win_h - box.y - box.h, box.w, box.h);
     }
+    glClear(GL_COLOR_BUFFER_BIT);
 
-/*
-// Top-left aligned text
-float pad_x = 6.0f;   // left padding
-float pad_y = 20.0f;  // baseline offset from top
-float scale = fmaxf(0.6f,(keys[i].h*0.6f)/32.0f);
-
-float tx = keys[i].x + pad_x;
-float ty = keys[i].y + pad_y;
-
-//    glUseProgram(text_prog);
-
-draw_text(s, tx, ty, scale, win_w, win_h);
-*/
-
-}
-
-
-
+    // Cached face for the current modifier state + whatever is held down;
+    // full redraw if offscreen layers are unavailable.
+    if (draw_key_layer(win_w, win_h, keys, nkeys))
+        draw_pressed_overlays(win_w, win_h, keys, nkeys, pressed);
+    else
+        draw_keyboard(win_w, win_h, keys, nkeys, pressed);
 
     // --- Draw popup menu above Preferences key ---
 
 // --- Draw popup menu above Preferences key ---
 if (menu_visible) {
+    prof_phase(PROF_MENU);
     for (int i=0; i<nkeys; i++) {
         if (keys[i].keysym == XK_Preferences) {
             draw_menu_above_key(keys[i], win_w, win_h);
@@ -1749,11 +3544,23 @@ if (menu_visible) {
 }
 
 
-    eglSwapBuffers(edpy,surf);
+    glDisable(GL_SCISSOR_TEST);
+    prof_gpu_end();
+    prof_phase(PROF_SWAP);
+    damage_swap(edpy, surf, win_w, win_h, partial);
+    prof_frame_end();
+    lat_presented();
     dirty = false;
+
+    if (frame_draw_calls != last_frame_draw_calls) {
+        printf("draw calls/frame: %d\n", frame_draw_calls);
+        last_frame_draw_calls = frame_draw_calls;
+    }
+    frame_draw_calls = 0;
 }
 
 
-        if(!XPending(dpy)) usleep(20000);
+        repeat_timer_arm(next_repeat);
+        loop_wait(dpy, next_repeat, -1);
     }
 }